@@ -1,11 +1,54 @@
 #include <stdio.h>
 
 #include "drv_test_hwd.h"
+#include "hwddb.h"
+
+/* List the registers in the database hwdc2 --db wrote */
+static void
+print_db(const char *filename)
+{
+    static uint32_t words[16384];
+    const char *bytes = (const char *)words;
+    const hwddb_header *h = (const hwddb_header *)bytes;
+    const hwddb_register *regs;
+    const hwddb_field *fields;
+    const char *strings;
+    FILE *f = fopen(filename, "rb");
+    size_t n;
+    uint32_t i, j;
+
+    if (f == NULL)
+        return;
+    n = fread(words, 1, sizeof(words), f);
+    fclose(f);
+    if (n < sizeof(*h) || h->magic != HWDDB_MAGIC || h->version != HWDDB_VERSION ||
+        h->file_size != n)
+    {
+        printf("%s: bad database\n", filename);
+        return;
+    }
+
+    regs = (const hwddb_register *)(bytes + h->registers);
+    fields = (const hwddb_field *)(bytes + h->fields);
+    strings = bytes + h->strings;
+    for (i = 0; i != h->n_registers; ++i)
+    {
+        printf("%s at %#x reset %#x:", strings + regs[i].qname, regs[i].offset, regs[i].reset);
+        for (j = 0; j != regs[i].n_fields; ++j)
+        {
+            const hwddb_field *fld = &fields[regs[i].first_field + j];
+            printf(" %s mask %#x", strings + fld->name, fld->mask);
+        }
+        printf("\n");
+    }
+}
 
 int
 main()
 {
-    unsigned int v;
+    volatile unsigned int v;
+    unsigned int hw[1];
+    TEST_SHADOW shadow;
 
     v = TEST_REG1_RMKS(HI_FULL, LO_SOGGY);
 
@@ -19,6 +62,31 @@ main()
 
     printf("REG1(VAL(6), OF(4)): %#x\n", v);
 
+    v = TEST_REG1_DEFAULT;
+    TEST_REG1_UPDATE(&v, LO, DRY);
+    TEST_REG1_UPDATE(&v, HI, VAL(7), LO, OF(9));
+
+    printf("REG1 UPDATE(VAL(7), OF(9)): %#x\n", v);
+
+    TEST_SHADOW_INIT(&shadow);
+    TEST_REG1_SHADOW_UPDATE(&shadow, hw, LO, SOGGY);
+    hw[0] = 0;
+
+    printf("REG1 SHADOW_READ: %#x hw: %#x\n", TEST_REG1_SHADOW_READ(&shadow, hw), hw[0]);
+
+    TEST_REGS_AT(hw)->REG1 = TEST_REG1_DEFAULT;
+
+    printf("REG1 via TEST_REGS: %#x\n", hw[TEST_REG1_OFFSET / 4]);
+
+    printf("LOOKUP(0): %s LOOKUP(4): %s\n", TEST_LOOKUP(0)->name,
+        TEST_LOOKUP(4) == NULL ? "none" : TEST_LOOKUP(4)->name);
+
+    printf("lookup_name(TEST_REG1_HI): shift %u mask %#x\n",
+        drv_test_hwd_lookup_name("TEST_REG1_HI")->shift,
+        drv_test_hwd_lookup_name("TEST_REG1_HI")->mask);
+
+    print_db("drv_test_hwd.db");
+
     return 0;
 }
 
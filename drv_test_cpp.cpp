@@ -0,0 +1,35 @@
+#include <stdio.h>
+
+#include "drv_test_hwd.hpp"
+
+using namespace TEST;
+
+// Everything folds at compile time
+static_assert(REG1::make(REG1::HI::FULL, REG1::LO::SOGGY) == 0xffff5555, "make");
+static_assert(REG1::DEFAULT == 0x10002, "DEFAULT");
+
+int
+main()
+{
+    volatile hwd::reg_t v;
+
+    v = REG1::make(REG1::HI::FULL, REG1::LO::SOGGY);
+
+    printf("REG1(FULL, SOGGY): %#x\n", v);
+
+    v = REG1::DEFAULT;
+
+    printf("REG1_DEFAULT: %#x\n", v);
+
+    v = REG1::make(REG1::HI::val(6), REG1::LO::of(4));
+
+    printf("REG1(VAL(6), OF(4)): %#x\n", v);
+
+    v = REG1::DEFAULT;
+    REG1::modify(v, REG1::LO::DRY);
+    REG1::modify(v, REG1::HI::val(7), REG1::LO::of(9));
+
+    printf("REG1 UPDATE(VAL(7), OF(9)): %#x\n", v);
+
+    return 0;
+}
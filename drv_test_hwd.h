@@ -0,0 +1,284 @@
+#ifndef HWD_C_SUPPORT
+#define HWD_C_SUPPORT
+
+/* <register>_UPDATE(p, FIELD, VALUE, ...) sets any of the register's
+   fields in *p with one read and one write.  VALUE is any of the field's
+   values, VAL(x) or OF(x). */
+#define _HWD_M(r, f, v) _##r##_##f##_MASK
+#define _HWD_V(r, f, v) (((r##_##f##_##v) << _##r##_##f##_SHIFT) & _##r##_##f##_MASK)
+#define _HWD_M2(r, f, v) _HWD_M(r, f, v)
+#define _HWD_V2(r, f, v) _HWD_V(r, f, v)
+#define _HWD_M4(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M2(r, __VA_ARGS__)
+#define _HWD_V4(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V2(r, __VA_ARGS__)
+#define _HWD_M6(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M4(r, __VA_ARGS__)
+#define _HWD_V6(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V4(r, __VA_ARGS__)
+#define _HWD_M8(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M6(r, __VA_ARGS__)
+#define _HWD_V8(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V6(r, __VA_ARGS__)
+#define _HWD_M10(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M8(r, __VA_ARGS__)
+#define _HWD_V10(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V8(r, __VA_ARGS__)
+#define _HWD_M12(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M10(r, __VA_ARGS__)
+#define _HWD_V12(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V10(r, __VA_ARGS__)
+#define _HWD_M14(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M12(r, __VA_ARGS__)
+#define _HWD_V14(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V12(r, __VA_ARGS__)
+#define _HWD_M16(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M14(r, __VA_ARGS__)
+#define _HWD_V16(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V14(r, __VA_ARGS__)
+#define _HWD_M18(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M16(r, __VA_ARGS__)
+#define _HWD_V18(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V16(r, __VA_ARGS__)
+#define _HWD_M20(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M18(r, __VA_ARGS__)
+#define _HWD_V20(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V18(r, __VA_ARGS__)
+#define _HWD_M22(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M20(r, __VA_ARGS__)
+#define _HWD_V22(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V20(r, __VA_ARGS__)
+#define _HWD_M24(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M22(r, __VA_ARGS__)
+#define _HWD_V24(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V22(r, __VA_ARGS__)
+#define _HWD_M26(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M24(r, __VA_ARGS__)
+#define _HWD_V26(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V24(r, __VA_ARGS__)
+#define _HWD_M28(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M26(r, __VA_ARGS__)
+#define _HWD_V28(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V26(r, __VA_ARGS__)
+#define _HWD_M30(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M28(r, __VA_ARGS__)
+#define _HWD_V30(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V28(r, __VA_ARGS__)
+#define _HWD_M32(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M30(r, __VA_ARGS__)
+#define _HWD_V32(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V30(r, __VA_ARGS__)
+#define _HWD_M34(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M32(r, __VA_ARGS__)
+#define _HWD_V34(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V32(r, __VA_ARGS__)
+#define _HWD_M36(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M34(r, __VA_ARGS__)
+#define _HWD_V36(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V34(r, __VA_ARGS__)
+#define _HWD_M38(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M36(r, __VA_ARGS__)
+#define _HWD_V38(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V36(r, __VA_ARGS__)
+#define _HWD_M40(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M38(r, __VA_ARGS__)
+#define _HWD_V40(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V38(r, __VA_ARGS__)
+#define _HWD_M42(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M40(r, __VA_ARGS__)
+#define _HWD_V42(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V40(r, __VA_ARGS__)
+#define _HWD_M44(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M42(r, __VA_ARGS__)
+#define _HWD_V44(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V42(r, __VA_ARGS__)
+#define _HWD_M46(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M44(r, __VA_ARGS__)
+#define _HWD_V46(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V44(r, __VA_ARGS__)
+#define _HWD_M48(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M46(r, __VA_ARGS__)
+#define _HWD_V48(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V46(r, __VA_ARGS__)
+#define _HWD_M50(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M48(r, __VA_ARGS__)
+#define _HWD_V50(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V48(r, __VA_ARGS__)
+#define _HWD_M52(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M50(r, __VA_ARGS__)
+#define _HWD_V52(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V50(r, __VA_ARGS__)
+#define _HWD_M54(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M52(r, __VA_ARGS__)
+#define _HWD_V54(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V52(r, __VA_ARGS__)
+#define _HWD_M56(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M54(r, __VA_ARGS__)
+#define _HWD_V56(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V54(r, __VA_ARGS__)
+#define _HWD_M58(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M56(r, __VA_ARGS__)
+#define _HWD_V58(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V56(r, __VA_ARGS__)
+#define _HWD_M60(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M58(r, __VA_ARGS__)
+#define _HWD_V60(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V58(r, __VA_ARGS__)
+#define _HWD_M62(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M60(r, __VA_ARGS__)
+#define _HWD_V62(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V60(r, __VA_ARGS__)
+#define _HWD_M64(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M62(r, __VA_ARGS__)
+#define _HWD_V64(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V62(r, __VA_ARGS__)
+#define _HWD_N(...) _HWD_N_(__VA_ARGS__, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define _HWD_N_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, _33, _34, _35, _36, _37, _38, _39, _40, _41, _42, _43, _44, _45, _46, _47, _48, _49, _50, _51, _52, _53, _54, _55, _56, _57, _58, _59, _60, _61, _62, _63, _64, n, ...) n
+#define _HWD_U(n, r, p, ...) _HWD_U_(n, r, p, __VA_ARGS__)
+#define _HWD_U_(n, r, p, ...) \
+	(*(p) = (*(p) & ~(_HWD_M##n(r, __VA_ARGS__))) | (_HWD_V##n(r, __VA_ARGS__)))
+#define _HWD_UPDATE(r, p, ...) _HWD_U(_HWD_N(__VA_ARGS__), r, p, __VA_ARGS__)
+
+#endif
+
+#define TEST_REG1_OFFSET 0
+#define _TEST_REG1_HI_SHIFT 16
+#define _TEST_REG1_HI_MASK 0xffff0000
+#define TEST_REG1_HI_OF(x) (x)
+#define _TEST_REG1_arg1_HI_OF(x) (x)
+#define TEST_REG1_HI_VAL(x) (((x) >> 0) & 0xffff)
+#define _TEST_REG1_arg1_HI_VAL(x) (((x) >> 0) & 0xffff)
+#define TEST_REG1_HI_DEFAULT 1
+#define _TEST_REG1_arg1_HI_DEFAULT 1
+#define TEST_REG1_HI_FULL 0xffff
+#define _TEST_REG1_arg1_HI_FULL 0xffff
+#define TEST_REG1_HI_EMPTY 0
+#define _TEST_REG1_arg1_HI_EMPTY 0
+
+#define _TEST_REG1_LO_SHIFT 0
+#define _TEST_REG1_LO_MASK 0xffff
+#define TEST_REG1_LO_OF(x) (x)
+#define _TEST_REG1_arg2_LO_OF(x) (x)
+#define TEST_REG1_LO_VAL(x) (((x) >> 0) & 0xffff)
+#define _TEST_REG1_arg2_LO_VAL(x) (((x) >> 0) & 0xffff)
+#define TEST_REG1_LO_DEFAULT 2
+#define _TEST_REG1_arg2_LO_DEFAULT 2
+#define TEST_REG1_LO_SOGGY 0x5555
+#define _TEST_REG1_arg2_LO_SOGGY 0x5555
+#define TEST_REG1_LO_DRY 0
+#define _TEST_REG1_arg2_LO_DRY 0
+
+#define TEST_REG1_RMK(_hi,_lo) (\
+	((_hi) << _TEST_REG1_HI_SHIFT) | \
+	((_lo) << _TEST_REG1_LO_SHIFT))
+#define TEST_REG1_RMKS(_hi,_lo) (\
+	((_TEST_REG1_arg1_##_hi) << _TEST_REG1_HI_SHIFT) | \
+	((_TEST_REG1_arg2_##_lo) << _TEST_REG1_LO_SHIFT))
+#define TEST_REG1_DEFAULT (\
+	(TEST_REG1_HI_DEFAULT << _TEST_REG1_HI_SHIFT) | \
+	(TEST_REG1_LO_DEFAULT << _TEST_REG1_LO_SHIFT))
+
+#define TEST_REG1_UPDATE(p, ...) _HWD_UPDATE(TEST_REG1, p, __VA_ARGS__)
+#ifndef HWD_C_OVERLAY
+#define HWD_C_OVERLAY
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+#define HWD_STATIC_ASSERT(c, m) static_assert(c, m)
+#else
+#define HWD_STATIC_ASSERT(c, m) _Static_assert(c, m)
+#endif
+
+#endif
+
+typedef struct
+{
+	volatile unsigned int REG1; /* 0x0 */
+} TEST_REGS;
+HWD_STATIC_ASSERT(offsetof(TEST_REGS, REG1) == 0, "TEST_REGS layout");
+HWD_STATIC_ASSERT(sizeof(TEST_REGS) == 4, "TEST_REGS size");
+#define TEST_REGS_AT(base) ((TEST_REGS *)(base))
+
+#ifndef HWD_C_SHADOW
+#define HWD_C_SHADOW
+
+#ifndef HWD_CACHE_ALIGNED
+#ifdef _MSC_VER
+#define HWD_CACHE_ALIGNED __declspec(align(64))
+#else
+#define HWD_CACHE_ALIGNED __attribute__((aligned(64)))
+#endif
+#endif
+
+#define _HWD_REG(base, offset) (*(volatile unsigned int *)((char *)(base) + (offset)))
+
+#endif
+
+typedef struct
+{
+	HWD_CACHE_ALIGNED unsigned int regs[1];
+} TEST_SHADOW;
+#define TEST_SHADOW_INIT(s) (\
+	(s)->regs[0] = TEST_REG1_DEFAULT, (void)0)
+#define TEST_REG1_REFETCH 0
+#define TEST_REG1_SHADOW_READ(s, base) ((s)->regs[0])
+#define TEST_REG1_SHADOW_WRITE(s, base, v) (_HWD_REG(base, 0) = (s)->regs[0] = (v))
+#define TEST_REG1_SHADOW_UPDATE(s, base, ...) (\
+	_HWD_UPDATE(TEST_REG1, &(s)->regs[0], __VA_ARGS__), _HWD_REG(base, 0) = (s)->regs[0])
+
+#ifndef HWD_C_DISPATCH
+#define HWD_C_DISPATCH
+
+typedef struct
+{
+	const char *name;
+	unsigned int shift;
+	unsigned int width;
+	unsigned int mask;
+	unsigned int ro;
+} hwd_field_desc;
+
+typedef struct
+{
+	unsigned int offset;
+	const char *name;
+	unsigned int reset;
+	unsigned int ro_mask;
+	const hwd_field_desc *fields;
+	unsigned int n_fields;
+} hwd_reg_desc;
+
+/* The description at offset among n sorted by offset, or 0 */
+static inline const hwd_reg_desc *
+hwd_find_desc(const hwd_reg_desc *descs, unsigned int n, const unsigned int offset)
+{
+	while (n > 1)
+	{
+		const unsigned int half = n / 2;
+		descs = descs[half].offset <= offset ? descs + half : descs;
+		n -= half;
+	}
+	return n == 1 && descs->offset == offset ? descs : 0;
+}
+
+#endif
+
+static const hwd_field_desc TEST_FIELDS[] =
+{
+	{ "HI", 16, 16, 0xffff0000, 0 },
+	{ "LO", 0, 16, 0xffff, 0 },
+};
+static const hwd_reg_desc TEST_DESCS[] =
+{
+	{ 0x0, "TEST_REG1", TEST_REG1_DEFAULT, 0x0, &TEST_FIELDS[0], 2 },
+};
+static inline const hwd_reg_desc *
+TEST_LOOKUP(const unsigned int offset)
+{
+	static const unsigned short index[1] =
+	{
+		1,
+	};
+
+	if ((offset & 3) != 0 || offset >= 4 || index[offset >> 2] == 0)
+		return 0;
+	return &TEST_DESCS[index[offset >> 2] - 1];
+}
+
+#ifndef HWD_C_NAMES
+#define HWD_C_NAMES
+
+#include <string.h>
+
+#define HWD_NO_OFFSET 0xffffffffU
+
+typedef struct
+{
+	const char *name;
+	unsigned int offset;		/* Of the register, HWD_NO_OFFSET if unknown */
+	unsigned int shift;
+	unsigned int mask;		/* In place, all ones for a register */
+} hwd_name_desc;
+
+static inline unsigned long long
+hwd_name_hash(const char *name)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	while (*name != '\0')
+		h = (h ^ (unsigned char)*name++) * 1099511628211ULL;
+	return h;
+}
+
+static inline unsigned int
+hwd_name_mix(unsigned long long h, const unsigned int seed)
+{
+	h ^= seed * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (unsigned int)h;
+}
+
+#endif
+
+static const unsigned int drv_test_hwd_NAME_SEEDS[1] =
+{
+	0x3,
+};
+static const hwd_name_desc drv_test_hwd_NAMES[3] =
+{
+	{ "TEST_REG1", 0x0, 0, 0xffffffff },
+	{ "TEST_REG1_LO", 0x0, 0, 0xffff },
+	{ "TEST_REG1_HI", 0x0, 16, 0xffff0000 },
+};
+static inline const hwd_name_desc *
+drv_test_hwd_lookup_name(const char *name)
+{
+	const unsigned long long h = hwd_name_hash(name);
+	const unsigned int seed = drv_test_hwd_NAME_SEEDS[hwd_name_mix(h, 0) % 1];
+	const hwd_name_desc *d = &drv_test_hwd_NAMES[seed & 0x80000000U ?
+		seed & 0x7fffffffU : hwd_name_mix(h, seed) % 3];
+	return strcmp(d->name, name) == 0 ? d : 0;
+}
+
@@ -0,0 +1,104 @@
+#ifndef HWD_CPP_SUPPORT
+#define HWD_CPP_SUPPORT
+
+#include <cstdint>
+#include <type_traits>
+
+static_assert(__cplusplus >= 201703L, "hwdc2 C++ headers need C++17");
+
+namespace hwd
+{
+	typedef std::uint32_t reg_t;
+
+	// A value for field F, already shifted into place
+	template <class F>
+	struct value
+	{
+		reg_t bits;
+	};
+
+	// Field F of register R, Width bits from bit Shift
+	template <class F, class R, unsigned Shift, unsigned Width, unsigned ValShift, bool ReadOnly>
+	struct field
+	{
+		typedef R reg;
+		static constexpr unsigned shift = Shift;
+		static constexpr unsigned width = Width;
+		static constexpr bool read_only = ReadOnly;
+		static constexpr reg_t bits = Width >= 32 ? ~reg_t(0) : (reg_t(1) << Width) - 1;
+		static constexpr reg_t mask = bits << Shift;
+
+		// As _OF, x as it is
+		static constexpr value<F> of(const reg_t x)
+		{
+			return value<F>{(x << Shift) & mask};
+		}
+
+		// As _VAL, the field's bits of x
+		static constexpr value<F> val(const reg_t x)
+		{
+			return of((x >> ValShift) & bits);
+		}
+
+		// The field from register value r
+		static constexpr reg_t get(const reg_t r)
+		{
+			return (r & mask) >> Shift;
+		}
+	};
+
+	// Register R, whose fields are members of it
+	template <class R>
+	struct reg
+	{
+		// old with the given fields replaced
+		// Fields of other registers and read only fields don't compile
+		template <class... F>
+		static constexpr reg_t update(const reg_t old, const value<F>... v)
+		{
+			static_assert((true && ... && std::is_same<typename F::reg, R>::value),
+				"field of another register");
+			static_assert(!(false || ... || F::read_only), "read only field");
+			return (old & ~(reg_t(0) | ... | F::mask)) | (reg_t(0) | ... | v.bits);
+		}
+
+		// Set the given fields of the register at r with one read and one write
+		template <class... F>
+		static void modify(volatile reg_t& r, const value<F>... v)
+		{
+			r = update(r, v...);
+		}
+
+		// As _RMKS, but fields not given keep their defaults
+		template <class... F>
+		static constexpr reg_t make(const value<F>... v)
+		{
+			return update(R::DEFAULT, v...);
+		}
+	};
+}
+
+#endif
+
+namespace TEST
+{
+	struct REG1 : hwd::reg<REG1>
+	{
+		static constexpr auto OFFSET = 0;
+		struct HI : hwd::field<HI, REG1, 16, 16, 0, false>
+		{
+			static constexpr hwd::value<HI> DEFAULT = of(1);
+			static constexpr hwd::value<HI> FULL = of(0xffff);
+			static constexpr hwd::value<HI> EMPTY = of(0);
+		};
+		struct LO : hwd::field<LO, REG1, 0, 16, 0, false>
+		{
+			static constexpr hwd::value<LO> DEFAULT = of(2);
+			static constexpr hwd::value<LO> SOGGY = of(0x5555);
+			static constexpr hwd::value<LO> DRY = of(0);
+		};
+		static constexpr hwd::reg_t DEFAULT =
+			HI::DEFAULT.bits |
+			LO::DEFAULT.bits;
+	};
+}
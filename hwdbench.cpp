@@ -0,0 +1,430 @@
+// hwdbench - throughput benchmark for hwdc2
+//
+// Generates synthetic register maps of a given shape and times hwdc2 on
+// them, optionally checking the results against a stored baseline.
+//
+//   hwdbench gen [<shape>]
+//       Write a synthetic .hwd map to stdout
+//   hwdbench run [<shape>] [-n <reps>] [--baseline <file>] [--update-baseline <file>]
+//           [--tolerance <percent>] <hwdc2>
+//       Time hwdc2 parsing, and parsing plus generating, a synthetic map
+//
+// Shape options give the size of the map:
+//   -b <blocks>   top level blocks
+//   -r <regs>     registers per block
+//   -f <fields>   fields per register
+//   -v <values>   values per field (besides DEFAULT)
+//   -d <depth>    levels of section from a block down to its registers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+class map_shape
+{
+public:
+	int blocks;
+	int regs;
+	int fields;
+	int values;
+	int depth;
+
+	map_shape() :
+		blocks(100),
+		regs(32),
+		fields(8),
+		values(4),
+		depth(2)
+	{
+		// Empty
+	}
+
+	long n_fields() const
+	{
+		return (long)blocks * regs * fields;
+	}
+
+	string describe() const
+	{
+		char buf[128];
+		snprintf(buf, sizeof(buf), "blocks=%d regs=%d fields=%d values=%d depth=%d",
+			blocks, regs, fields, values, depth);
+		return string(buf);
+	}
+};
+
+// Write a synthetic map of the given shape
+// Fields share out the 32 bits of each register, every fourth one is read
+// only and comments turn up now and then so the lexer has some to strip.
+static void
+generate_map(FILE * const f, const map_shape& shape)
+{
+	const int width = shape.fields > 32 ? 1 : 32 / shape.fields;
+
+	fprintf(f, "// Synthetic register map: %s\n\n", shape.describe().c_str());
+
+	for (int b = 0; b != shape.blocks; ++b)
+	{
+		string indent;
+
+		fprintf(f, "BLK%d {\n", b);
+		for (int d = 1; d < shape.depth; ++d)
+		{
+			indent += '\t';
+			fprintf(f, "%sSUB%d {\n", indent.c_str(), d);
+		}
+		indent += '\t';
+
+		for (int r = 0; r != shape.regs; ++r)
+		{
+			fprintf(f, "%sREG%d {\t// register %d\n", indent.c_str(), r, r);
+			fprintf(f, "%s\tOFFSET=0x%x\n", indent.c_str(), r * 4);
+
+			for (int i = 0; i != shape.fields; ++i)
+			{
+				const int shift = (i * width) % 32;
+
+				fprintf(f, "%s\t%sF%d[%d,%d] {DEFAULT=0", indent.c_str(),
+					i % 4 == 3 ? "_" : "", i, shift, width);
+				for (int v = 0; v != shape.values; ++v)
+					fprintf(f, " V%d=%d", v, v & ((1 << (width > 30 ? 30 : width)) - 1));
+				fprintf(f, "}\n");
+			}
+			fprintf(f, "%s}\n", indent.c_str());
+		}
+
+		for (int d = shape.depth; d > 0; --d)
+		{
+			indent.erase(indent.length() - 1);
+			fprintf(f, "%s}\n", indent.c_str());
+		}
+	}
+}
+
+class run_result
+{
+public:
+	double seconds;
+	long peak_rss_kb;
+	bool ok;
+
+	run_result() :
+		seconds(0),
+		peak_rss_kb(0),
+		ok(false)
+	{
+		// Empty
+	}
+};
+
+static double
+now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Run a command with its stdout thrown away, timing it
+static run_result
+run(const vector<string>& args)
+{
+	run_result res;
+	vector<char *> argv;
+
+	for (size_t i = 0; i != args.size(); ++i)
+		argv.push_back((char *)args[i].c_str());
+	argv.push_back(NULL);
+
+	const double start = now();
+	const pid_t pid = fork();
+	if (pid < 0)
+		return res;
+
+	if (pid == 0)
+	{
+		const int null_fd = open("/dev/null", O_WRONLY);
+		if (null_fd >= 0)
+			dup2(null_fd, 1);
+		execv(argv[0], &argv[0]);
+		_exit(127);
+	}
+
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) != pid)
+		return res;
+
+	res.seconds = now() - start;
+	res.peak_rss_kb = ru.ru_maxrss;
+	res.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	return res;
+}
+
+// Best of reps runs
+static run_result
+best_of(const vector<string>& args, const int reps)
+{
+	run_result best;
+
+	for (int i = 0; i != reps; ++i)
+	{
+		const run_result r = run(args);
+		if (!r.ok)
+			return r;
+		if (i == 0 || r.seconds < best.seconds)
+			best.seconds = r.seconds;
+		if (r.peak_rss_kb > best.peak_rss_kb)
+			best.peak_rss_kb = r.peak_rss_kb;
+		best.ok = true;
+	}
+	return best;
+}
+
+// A named measurement and which way is better
+class metric
+{
+public:
+	string name;
+	double value;
+	bool higher_better;
+
+	metric(const string& n, const double v, const bool hb) :
+		name(n),
+		value(v),
+		higher_better(hb)
+	{
+		// Empty
+	}
+};
+
+static void
+write_results(FILE * const f, const map_shape& shape, const vector<metric>& results)
+{
+	fprintf(f, "shape=%s\n", shape.describe().c_str());
+	for (size_t i = 0; i != results.size(); ++i)
+		fprintf(f, "%s=%.3f\n", results[i].name.c_str(), results[i].value);
+}
+
+// Check results against a baseline written by write_results
+// Returns false if anything is more than tolerance (a fraction) worse
+static bool
+check_baseline(const char * const filename, const map_shape& shape,
+	const vector<metric>& results, const double tolerance)
+{
+	FILE * const f = fopen(filename, "r");
+	if (f == NULL)
+	{
+		fprintf(stderr, "hwdbench: cannot open baseline '%s'\n", filename);
+		return false;
+	}
+
+	bool ok = true;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		char * const eq = strchr(line, '=');
+		if (line[0] == '#' || eq == NULL)
+			continue;
+		*eq = '\0';
+		string value(eq + 1);
+		while (!value.empty() && (value[value.length() - 1] == '\n' || value[value.length() - 1] == '\r'))
+			value.erase(value.length() - 1);
+
+		if (strcmp(line, "shape") == 0)
+		{
+			if (value != shape.describe())
+			{
+				printf("baseline is for a different map (%s) - not compared\n", value.c_str());
+				fclose(f);
+				return true;
+			}
+			continue;
+		}
+
+		for (size_t i = 0; i != results.size(); ++i)
+		{
+			if (results[i].name != line)
+				continue;
+
+			const double base = atof(value.c_str());
+			const bool worse = results[i].higher_better ?
+				results[i].value < base * (1 - tolerance) :
+				results[i].value > base * (1 + tolerance);
+			printf("%-24s %12.3f  baseline %12.3f  %s\n", line, results[i].value, base,
+				worse ? "REGRESSION" : "ok");
+			if (worse)
+				ok = false;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+static int
+usage()
+{
+	fprintf(stderr,
+		"Usage: hwdbench gen [<shape>]\n"
+		"       hwdbench run [<shape>] [-n <reps>] [--baseline <file>] [--update-baseline <file>]\n"
+		"               [--tolerance <percent>] <hwdc2>\n"
+		"Shape: [-b <blocks>] [-r <regs>] [-f <fields>] [-v <values>] [-d <depth>]\n");
+	return 2;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2)
+		return usage();
+
+	const string cmd(argv[1]);
+	map_shape shape;
+	int reps = 3;
+	double tolerance = 0.25;
+	const char * baseline = NULL;
+	const char * update = NULL;
+	int argi = 2;
+
+	for (; argi < argc && argv[argi][0] == '-'; ++argi)
+	{
+		const string arg(argv[argi]);
+		if (argi + 1 >= argc)
+			return usage();
+
+		const char * const val = argv[++argi];
+		if (arg == "-b")
+			shape.blocks = atoi(val);
+		else if (arg == "-r")
+			shape.regs = atoi(val);
+		else if (arg == "-f")
+			shape.fields = atoi(val);
+		else if (arg == "-v")
+			shape.values = atoi(val);
+		else if (arg == "-d")
+			shape.depth = atoi(val);
+		else if (arg == "-n")
+			reps = atoi(val);
+		else if (arg == "--baseline")
+			baseline = val;
+		else if (arg == "--update-baseline")
+			update = val;
+		else if (arg == "--tolerance")
+			tolerance = atof(val) / 100;
+		else
+			return usage();
+	}
+
+	if (shape.blocks < 1 || shape.regs < 1 || shape.fields < 1 || shape.values < 0 ||
+		shape.depth < 1 || reps < 1)
+	{
+		return usage();
+	}
+
+	if (cmd == "gen")
+	{
+		if (argi != argc)
+			return usage();
+		generate_map(stdout, shape);
+		return 0;
+	}
+
+	if (cmd != "run" || argi + 1 != argc)
+		return usage();
+
+	char map_name[64];
+	char out_name[64];
+	snprintf(map_name, sizeof(map_name), "/tmp/hwdbench.%ld.hwd", (long)getpid());
+	snprintf(out_name, sizeof(out_name), "/tmp/hwdbench.%ld.h", (long)getpid());
+
+	FILE * const f = fopen(map_name, "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "hwdbench: cannot write '%s'\n", map_name);
+		return 1;
+	}
+	generate_map(f, shape);
+	const double map_mb = ftell(f) / 1e6;
+	fclose(f);
+
+	vector<string> parse_args;
+	parse_args.push_back(argv[argi]);
+	parse_args.push_back("-j");
+	parse_args.push_back("1");
+	parse_args.push_back("--parse-only");
+	parse_args.push_back(map_name);
+
+	vector<string> full_args;
+	full_args.push_back(argv[argi]);
+	full_args.push_back("-j");
+	full_args.push_back("1");
+	full_args.push_back(map_name);
+	full_args.push_back(out_name);
+
+	const run_result parse = best_of(parse_args, reps);
+	const run_result full = best_of(full_args, reps);
+
+	struct stat st;
+	const double out_mb = stat(out_name, &st) == 0 ? st.st_size / 1e6 : 0;
+	unlink(map_name);
+	unlink(out_name);
+
+	if (!parse.ok || !full.ok)
+	{
+		fprintf(stderr, "hwdbench: '%s' failed\n", argv[argi]);
+		return 1;
+	}
+
+	const double gen_seconds = full.seconds > parse.seconds ? full.seconds - parse.seconds : 1e-6;
+
+	printf("map: %s\n", shape.describe().c_str());
+	printf("     %ld fields, %.2f MB in, %.2f MB out, best of %d\n",
+		shape.n_fields(), map_mb, out_mb, reps);
+	printf("parse:    %8.3f s  %12.0f fields/s  %8.2f MB/s\n",
+		parse.seconds, shape.n_fields() / parse.seconds, map_mb / parse.seconds);
+	printf("generate: %8.3f s  %12.0f fields/s  %8.2f MB/s out\n",
+		gen_seconds, shape.n_fields() / gen_seconds, out_mb / gen_seconds);
+	printf("total:    %8.3f s  %12.0f fields/s  %8.2f MB/s\n",
+		full.seconds, shape.n_fields() / full.seconds, map_mb / full.seconds);
+	printf("peak RSS: %8ld KB\n", full.peak_rss_kb);
+
+	vector<metric> results;
+	results.push_back(metric("parse_fields_per_sec", shape.n_fields() / parse.seconds, true));
+	results.push_back(metric("parse_mb_per_sec", map_mb / parse.seconds, true));
+	results.push_back(metric("generate_fields_per_sec", shape.n_fields() / gen_seconds, true));
+	results.push_back(metric("total_fields_per_sec", shape.n_fields() / full.seconds, true));
+	results.push_back(metric("peak_rss_kb", (double)full.peak_rss_kb, false));
+
+	if (update != NULL)
+	{
+		FILE * const bf = fopen(update, "w");
+		if (bf == NULL)
+		{
+			fprintf(stderr, "hwdbench: cannot write baseline '%s'\n", update);
+			return 1;
+		}
+		fprintf(bf, "# hwdbench baseline - regenerate with 'make bench-baseline'\n");
+		write_results(bf, shape, results);
+		fclose(bf);
+		printf("baseline written to %s\n", update);
+	}
+
+	if (baseline != NULL && !check_baseline(baseline, shape, results, tolerance))
+	{
+		printf("FAILED: slower than baseline by more than %.0f%%\n", tolerance * 100);
+		return 1;
+	}
+
+	return 0;
+}
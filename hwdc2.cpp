@@ -4,12 +4,47 @@
 #define IS_UNIX 1
 #endif
 
+#ifdef __linux__
+#define HAS_INOTIFY 1
+#else
+#define HAS_INOTIFY 0
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cctype>
-#include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+#if IS_UNIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if HAS_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+#else
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <windows.h>
+#include <psapi.h>
+#endif
 #include "ptr.hpp"
+#include "hwddb.h"
 
 using namespace std;
 
@@ -38,6 +73,58 @@ itowstring(int i, const unsigned int radix = 10)
 	return wstring(p);
 }
 
+// 64-bit FNV-1a hash of some bytes
+// Not cryptographic - just good enough to tell contents apart
+class content_hash
+{
+	unsigned long long h;
+
+public:
+	virtual ~content_hash()
+	{
+		// Empty
+	}
+
+	content_hash() :
+		h(14695981039346656037ULL)
+	{
+		// Empty
+	}
+
+	content_hash& add(const void * const data, const size_t n)
+	{
+		const unsigned char * const p = (const unsigned char *)data;
+		for (size_t i = 0; i != n; ++i)
+			h = (h ^ p[i]) * 1099511628211ULL;
+		return *this;
+	}
+
+	content_hash& add(const string& str)
+	{
+		return add(str.data(), str.length());
+	}
+
+	unsigned long long value() const
+	{
+		return h;
+	}
+
+	// As 16 hex digits
+	string hex() const
+	{
+		char buf[17];
+		for (int i = 0; i != 16; ++i)
+			buf[i] = "0123456789abcdef"[(h >> (60 - 4 * i)) & 0xf];
+		buf[16] = '\0';
+		return string(buf);
+	}
+};
+
+// Identifies the code generator for cached output
+// Any rebuild of hwdc2 may change what it generates so the build time is
+// part of it
+static const char hwdc2_version[] = "hwdc2 2 " __DATE__ " " __TIME__;
+
 class hwdc_error
 {
 	wstring err_text;
@@ -55,6 +142,25 @@ public:
 		err_text += text;
 	}
 
+	// As above but naming the file, for errors in files other than the one
+	// being compiled
+	hwdc_error(const wstring& file, int line_no, const wstring& text) :
+		err_text(file.empty() ? file : file + L":")
+	{
+		err_text += itowstring(line_no);
+		err_text += L": ";
+		err_text += text;
+	}
+
+	// For anything else thrown, such as running out of memory, so a worker
+	// thread can hand it back like any other error
+	explicit hwdc_error(const std::exception& err) :
+		err_text(L"0: ")
+	{
+		const string what(err.what());
+		err_text += wstring(what.begin(), what.end());
+	}
+
 	operator wstring() const
 	{
 		return err_text;
@@ -62,634 +168,5051 @@ public:
 };
 
 #if IS_UNIX
-typedef const char * filename_t;
+typedef char filename_char;
 #else
-typedef const wchar_t * filename_t;
+typedef wchar_t filename_char;
 #endif
+typedef const filename_char * filename_t;
+typedef basic_string<filename_char> filename_str;
 
-class pp_stream
+// Read-only view of an entire input file
+// Memory mapped where possible so the lexer can walk the raw bytes without
+// any per-character stream or locale overhead.  Anything that can't be
+// mapped, such as a pipe, is read into memory instead, as is everything
+// when may_map is false because the file may change while we look at it.
+class mapped_file
 {
-	bool ungot;
-	int last_c;
-	int line_no;
-	wifstream stream_in;
+	const char * base;
+	size_t size;
+	bool opened;
+	bool mapped;
+	string owned;		// What was read when not mapped
+#if IS_UNIX
+	int fd;
+#else
+	HANDLE file;
+	HANDLE mapping;
+#endif
+
+	mapped_file(const mapped_file&);
+	mapped_file& operator= (const mapped_file&);
+
+	void read_all();
 
 public:
-	virtual ~pp_stream()
+	virtual ~mapped_file()
 	{
-		// Empty
+#if IS_UNIX
+		if (mapped)
+			munmap((void *)base, size);
+		if (fd >= 0)
+			close(fd);
+#else
+		if (mapped)
+			UnmapViewOfFile(base);
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#endif
 	}
 
-	pp_stream(const filename_t filename) :
-		ungot(false),
-		last_c(-1),
-		line_no(1),
-		stream_in(filename)
+	mapped_file(const filename_t filename, const bool may_map = true) :
+		base(NULL),
+		size(0),
+		opened(false),
+		mapped(false)
 	{
-		// Empty
-		wcout << L"Opening '" << filename << L"': open is " << stream_in.is_open() << L"\n";
-	}
+#if IS_UNIX
+		struct stat st;
 
-	int get(const bool quoted = false)
-	{
-		wint_t c;
+		if ((fd = open(filename, O_RDONLY)) < 0)
+			return;
+		opened = true;
 
-		if (ungot)
+		if (may_map && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size != 0)
 		{
-			ungot = false;
-			c = last_c;
-		}
-		else
-		{
-			c = stream_in.get();
+			void * const p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				base = (const char *)p;
+				size = (size_t)st.st_size;
+				mapped = true;
+				madvise(p, size, MADV_SEQUENTIAL);
+				return;
+			}
 		}
+#else
+		mapping = NULL;
+		file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		opened = true;
 
-		// Dump comments
-		if (!quoted && c == '/' && stream_in.peek() == '/')
+		LARGE_INTEGER li;
+		if (may_map && GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &li) &&
+			li.QuadPart != 0 &&
+			(mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL)) != NULL)
 		{
-			while ((c = stream_in.get()) != WEOF && c != L'\n')
-				/* loop */;
+			base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			if (base != NULL)
+			{
+				size = (size_t)li.QuadPart;
+				mapped = true;
+				return;
+			}
 		}
-
-		if (c == '\n')
-			++line_no;
-
-		last_c = c;
-		return c;
+#endif
+		read_all();
 	}
 
-	void unget()
+	bool is_open() const
 	{
-		ungot = true;
-		if (last_c == '\n')
-			--line_no;
+		return opened;
 	}
 
-	int line() const
+	const char * begin() const
 	{
-		return line_no;
+		return base;
 	}
 
-	void skip_ws()
+	const char * end() const
 	{
-		int c;
-		while (iswspace(c = get()))
-		{
-			// Loop
-		}
-		unget();
+		return base + size;
 	}
 };
 
-class thing_sequence;
-
-class thing : public virtual Pted
+// Read whatever is left of the file into memory
+// A file that can't be read is treated as one that can't be opened
+void mapped_file::read_all()
 {
-public:
-	enum eType
-	{
-		empty,
-		eof,
-		unquoted_str,
-		quoted_str,
-		number,
-		section_start,
-		section_end,
-		square_bracket_start,
-		square_bracket_end,
-		assign,
-		comma,
-		op
-	};
-
-private:
-	enum eType thing_type;
-	int line_no;
-	wstring strval;
-	long numval;
-	Ptr<thing_sequence> section;
-	Ptr<thing> parent;
+	char buf[64 * 1024];
 
-	static inline bool isidentifier(const int c)
+	for (;;)
 	{
-		return isalnum(c) || c == '_';
+#if IS_UNIX
+		const ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			opened = false;
+#else
+		// A pipe whose writer has finished reads as broken
+		DWORD n = 0;
+		if (!ReadFile(file, buf, sizeof(buf), &n, NULL) && GetLastError() != ERROR_BROKEN_PIPE)
+			opened = false;
+#endif
+		if (!opened || n == 0)
+			break;
+		owned.append(buf, (size_t)n);
 	}
 
-public:
-	virtual ~thing()
+	if (opened)
 	{
-		// Empty
+		base = owned.data();
+		size = owned.length();
 	}
+}
 
-	thing() :
-		thing_type(empty),
-		numval(0)
-	{
-		// Empty
-	}
+// Generated output
+// Accumulated as bytes in memory and written in large chunks with as few
+// system calls as we can, rather than a fragment at a time through a wide
+// stream.  Wide text is narrowed a character at a time: all of it is either
+// ASCII or was widened a byte at a time from the input, so this gives back
+// the input's own bytes.
+class out_buffer
+{
+	string buf;
+	int fd;
+	bool owned;
+	size_t flushed;
 
-	pp_stream& operator<< (pp_stream& in)
-	{
-		numval = 0;
+	// Counting macro definitions as the output goes past
+	bool counting;
+	size_t n_macros;
+	size_t tallied;
+	int match;
 
-		in.skip_ws();
+	enum { flush_size = 1024 * 1024 };
 
-		// Set the line_no of this thing after skipping whitespace which may
-		// well contain newlines
-		line_no = in.line();
+	out_buffer(const out_buffer&);
+	out_buffer& operator= (const out_buffer&);
 
-		wint_t c = in.get();
-		if (c == WEOF)
-		{
-			thing_type = eof;
-		}
-		else if (c == '"')
-		{
-			thing_type = quoted_str;
-			while ((c = in.get()) != '"')
-			{
-				// ******** throw error on EOF or '\n'
-				strval += (wchar_t)c;
-			}
-		}
-		else if (isidentifier(c))
-		{
-			thing_type = unquoted_str;
+	void write_out(const char * p, size_t n);
 
-			// Accumulate string
-			for (; isidentifier(c); c = in.get())
-			{
-				strval += (wchar_t)c;
-			}
-			in.unget();
+	inline void check_flush()
+	{
+		if (buf.length() >= flush_size && fd >= 0)
+			flush();
+	}
 
-			// Test if this is a valid number and if so then mark as such
-			// At the moment we use strtol for conversion but this might want
-			// to be changed if we want binary numbers too.
-			{
-				wchar_t * endptr;
-				const wchar_t * const cstr = strval.c_str();
-				numval = wcstol(cstr, &endptr, 0);
-				// Its a good number if strtol consumes the entire string
-				if ((size_t)(endptr - cstr) == strval.length())
-				{
-					thing_type = number;
-				}
-			}
-		}
-		else if (c == '{')
-		{
-			thing_type = section_start;
-		}
-		else if (c == '}')
-		{
-			thing_type = section_end;
-		}
-		else if (c == '[')
-		{
-			thing_type = square_bracket_start;
-		}
-		else if (c == ']')
-		{
-			thing_type = square_bracket_end;
-		}
-		else if (c == '=')
+	void tally();
+
+public:
+	virtual ~out_buffer()
+	{
+		// Leave whatever we got to in the file even if we gave up part way
+		try
 		{
-			thing_type = assign;
+			close();
 		}
-		else if (c == ',')
+		catch (hwdc_error&)
 		{
-			thing_type = comma;
+			// Nothing more to be done
 		}
-		else
+	}
+
+	// Just collects output until someone takes it with str()
+	out_buffer() :
+		fd(-1),
+		owned(false),
+		flushed(0),
+		counting(false),
+		n_macros(0),
+		tallied(0),
+		match(0)
+	{
+		// Empty
+	}
+
+	// Output to the named file or stdout if none
+	void open(const filename_t filename);
+
+	void flush()
+	{
+		if (fd >= 0 && !buf.empty())
 		{
-			thing_type = op;
-			strval = (wchar_t)c;
+			if (counting)
+				tally();
+			// Anything logged to wcout so far must come out first when we
+			// share stdout with it
+			if (fd == 1)
+				wcout.flush();
+			write_out(buf.data(), buf.length());
+			flushed += buf.length();
+			buf.clear();
+			tallied = 0;
 		}
-		return in;
 	}
 
-	thing(pp_stream& in) :
-		thing_type(empty),
-		numval(0)
+	// Count the #defines in everything output from now on
+	void count_macros()
 	{
-		*this << in;
+		counting = true;
 	}
 
-	bool isro() const
+	size_t macros()
 	{
-		return !strval.empty() && strval[0] == '_';
+		tally();
+		return n_macros;
 	}
 
-	bool iseof() const
+	// Everything output, including what has already been written
+	size_t total() const
 	{
-		return thing_type == eof;
+		return flushed + buf.length();
 	}
 
-	eType el_type() const
+	void close();
+
+	const string& str() const
 	{
-		return thing_type;
+		return buf;
 	}
 
-	const wstring& el_string() const
+	size_t length() const
 	{
-		return strval;
+		return buf.length();
 	}
 
-	const int el_number() const
+	out_buffer& operator<< (const char * p)
 	{
-		return numval;
+		buf += p;
+		check_flush();
+		return *this;
 	}
 
-	int el_line_no() const
+	out_buffer& operator<< (const string& str)
 	{
-		return line_no;
+		buf += str;
+		check_flush();
+		return *this;
 	}
 
-	thing_sequence& el_sequence() const
+	out_buffer& operator<< (const wchar_t * p)
 	{
-		return *section;
+		while (*p != 0)
+			buf += (char)*p++;
+		check_flush();
+		return *this;
 	}
 
-	const wstring el_name(int offset = 0, int depth = 0) const
+	out_buffer& operator<< (const wstring& str)
 	{
-		return offset > 0 ? (parent.isnull() ? wstring() : parent->el_name(offset - 1, depth)) :
-			parent.isnull() || depth == 1 ? el_string().substr(isro() ? 1 : 0) :
-			parent->el_name(0, depth - 1) + L"_" + el_string().substr(isro() ? 1 : 0);
+		const size_t n = str.length();
+		const size_t base = buf.length();
+		buf.resize(base + n);
+		for (size_t i = 0; i != n; ++i)
+			buf[base + i] = (char)str[i];
+		check_flush();
+		return *this;
 	}
 
-	void fix_reserved(int argno)
+	out_buffer& operator<< (const wchar_t c)
 	{
-		if (strval == L"_")
-		{
-			strval = L"_Reserved";
-			strval += itowstring(argno);
-		}
+		buf += (char)c;
+		return *this;
 	}
 
-	const wstring el_argname() const
+	out_buffer& operator<< (const long i)
 	{
-		const size_t wlen = strval.length();
-		wstring x;
-		x.reserve(wlen + 1);
-		x += L'_';
-		for (size_t i = 0; i != wlen; ++i)
-		{
-			x += towlower(strval[i]);
-		}
-		return x;
-	}
+		char tmp[24];
+		char * p = tmp + sizeof(tmp);
+		unsigned long u = i < 0 ? 0UL - (unsigned long)i : (unsigned long)i;
 
+		do
+		{
+			*--p = (char)('0' + u % 10);
+			u /= 10;
+		} while (u != 0);
 
-	void set_sequence(thing_sequence * const seq);
+		if (i < 0)
+			*--p = '-';
 
-	void set_parent(thing * new_parent)
-	{
-		parent = new_parent;
+		buf.append(p, tmp + sizeof(tmp) - p);
+		return *this;
 	}
-};
 
-class syntax_error : public hwdc_error
-{
-public:
-	virtual ~syntax_error()
+	out_buffer& operator<< (const int i)
 	{
-		// Empty
+		return *this << (long)i;
 	}
 
-	syntax_error(const thing& bad_thing) :
-		hwdc_error(bad_thing.el_line_no(), wstring(L"Syntax error near thing: ") + bad_thing.el_string())
+	out_buffer& operator<< (const size_t i)
 	{
-		// Empty
+		return *this << (long)i;
 	}
 };
 
-class thing_sequence: public virtual Pted, public PtrList<thing>
+// Count lines starting "#define" in what we haven't looked at yet
+// Carries on from where the last look left off, part way through a line
+void out_buffer::tally()
 {
-public:
-	virtual ~thing_sequence()
-	{
-		// Empty
-	}
+	static const char define[] = "#define";
 
-	thing_sequence()
+	for (; tallied != buf.length(); ++tallied)
 	{
-		// Empty
-	}
+		const char c = buf[tallied];
 
-	thing_sequence(pp_stream& in, const thing::eType expected_end = thing::eof);
-	virtual void generate_c(wostream& os, thing * parent = NULL, const int argno = 0);
-
-	thing& extract(size_t i)
-	{
-		if (i >= len())
+		if (match >= 0)
 		{
-			throw syntax_error(*(*this)[i - 1]);
+			if (c == define[match])
+			{
+				if (++match == (int)sizeof(define) - 1)
+				{
+					++n_macros;
+					match = -1;
+				}
+			}
+			else
+			{
+				match = -1;
+			}
 		}
-		return *(*this)[i];
+		if (c == '\n')
+			match = 0;
 	}
+}
 
-	virtual wstring sb_val() const
+void out_buffer::open(const filename_t filename)
+{
+	close();
+
+	if (filename == NULL)
 	{
-		return wstring();
+		fd = 1;
+		owned = false;
+		return;
 	}
-};
 
-class square_bracket_sequence : public thing_sequence
+#if IS_UNIX
+	fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#else
+	fd = _wopen(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_TEXT, _S_IREAD | _S_IWRITE);
+#endif
+	if (fd < 0)
+		throw hwdc_error(0, L"Cannot open output file");
+	owned = true;
+}
+
+void out_buffer::close()
 {
-	int val_shift;
-	int field_shift;
-	int mask;
+	if (fd < 0)
+		return;
 
-public:
-	virtual ~square_bracket_sequence()
+	const int old_fd = fd;
+	const bool was_owned = owned;
+	try
 	{
-		// Empty
+		flush();
 	}
-	square_bracket_sequence(pp_stream& in) :
-		thing_sequence(in, thing::square_bracket_end),
-		val_shift(0),
-		field_shift(0),
-		mask(0)
+	catch (hwdc_error&)
 	{
-		// Empty
+		fd = -1;
+		if (was_owned)
+#if IS_UNIX
+			::close(old_fd);
+#else
+			_close(old_fd);
+#endif
+		throw;
 	}
 
-	virtual void generate_c(wostream& os, thing * parent = NULL, const int argno = 0);
+	fd = -1;
+	if (was_owned)
+#if IS_UNIX
+		::close(old_fd);
+#else
+		_close(old_fd);
+#endif
+}
 
-	virtual wstring sb_val() const
+void out_buffer::write_out(const char * p, size_t n)
+{
+	while (n != 0)
 	{
-		return wstring (L"(((x) >> ") +
-			itowstring(val_shift) + wstring(L") & 0x") + itowstring(mask, 16) + wstring(L")");
+#if IS_UNIX
+		const ssize_t done = ::write(fd, p, n);
+		if (done < 0 && errno == EINTR)
+			continue;
+#else
+		const int done = _write(fd, p, n > 0x40000000 ? 0x40000000 : (unsigned int)n);
+#endif
+		if (done <= 0)
+			throw hwdc_error(0, L"Error writing output");
+		p += done;
+		n -= (size_t)done;
 	}
-};
+}
 
-class section_sequence : public thing_sequence
+// Write data to filename, replacing whatever was there
+static void
+write_file(const filename_t filename, const string& data)
+{
+	out_buffer outs;
+	outs.open(filename);
+	outs << data;
+	outs.close();
+}
+
+// Write data to filename unless it already holds exactly that, so that
+// an unchanged file keeps its timestamp
+// Returns true if the file was written
+static bool
+update_file(const filename_t filename, const string& data)
+{
+	{
+		mapped_file old(filename);
+		if (old.is_open() && (size_t)(old.end() - old.begin()) == data.length() &&
+			(data.empty() || memcmp(old.begin(), data.data(), data.length()) == 0))
+		{
+			return false;
+		}
+	}
+
+	write_file(filename, data);
+	return true;
+}
+
+// A name to write filename's new contents to before moving it into place,
+// unique to this write
+static filename_str
+temp_file_name(const filename_str& filename)
+{
+	static atomic<unsigned int> tmp_count(0);
+	const string suffix = ".tmp" + to_string(tmp_count++) + "-" +
+#if IS_UNIX
+		to_string((long)getpid());
+#else
+		to_string((long)GetCurrentProcessId());
+#endif
+	return filename + filename_str(suffix.begin(), suffix.end());
+}
+
+// Move the temporary file tmpname over filename
+static void
+move_into_place(const filename_str& tmpname, const filename_str& filename)
+{
+#if IS_UNIX
+	if (rename(tmpname.c_str(), filename.c_str()) != 0)
+#else
+	if (!MoveFileExW(tmpname.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+#endif
+		throw hwdc_error(0, L"Cannot replace file");
+}
+
+// Atomically replace filename with data by way of a temporary file, so a
+// concurrent reader sees either the old contents or the new
+static void
+replace_file(const filename_str& filename, const string& data)
+{
+	const filename_str tmpname = temp_file_name(filename);
+
+	write_file(tmpname.c_str(), data);
+	move_into_place(tmpname, filename);
+}
+
+// Read the whole of filename into data
+// Returns false if it can't be opened
+static bool
+read_file(const filename_t filename, string& data)
+{
+	mapped_file in(filename);
+	if (!in.is_open())
+		return false;
+	data.assign(in.begin(), in.end());
+	return true;
+}
+
+class pp_stream
+{
+	bool ungot;
+	int last_c;
+	int line_no;
+	wostream& log_to;
+	mapped_file source;
+	const char * cur;
+	const char * const limit;
+
+	inline wint_t next_byte()
+	{
+		return cur != limit ? (wint_t)(unsigned char)*cur++ : WEOF;
+	}
+
+public:
+	virtual ~pp_stream()
+	{
+		// Empty
+	}
+
+	pp_stream(const filename_t filename, wostream& log = wcout, const bool may_map = true) :
+		ungot(false),
+		last_c(-1),
+		line_no(1),
+		log_to(log),
+		source(filename, may_map),
+		cur(source.begin()),
+		limit(source.end())
+	{
+		// Empty
+		log_to << L"Opening '" << filename << L"': open is " << source.is_open() << L"\n";
+
+		// Tokens record their position as 32-bit offsets
+		if ((size_t)(limit - cur) > 0xffffffffU)
+			throw hwdc_error(0, L"Input file too large");
+	}
+
+	int get(const bool quoted = false)
+	{
+		wint_t c;
+
+		if (ungot)
+		{
+			ungot = false;
+			c = last_c;
+		}
+		else
+		{
+			c = next_byte();
+		}
+
+		// Dump comments
+		if (!quoted && c == '/' && cur != limit && *cur == '/')
+		{
+			while ((c = next_byte()) != WEOF && c != L'\n')
+				/* loop */;
+		}
+
+		if (c == '\n')
+			++line_no;
+
+		last_c = c;
+		return c;
+	}
+
+	void unget()
+	{
+		ungot = true;
+		if (last_c == '\n')
+			--line_no;
+	}
+
+	int line() const
+	{
+		return line_no;
+	}
+
+	// Offset in the source of the character the next get() returns
+	size_t offset() const
+	{
+		return (size_t)(cur - source.begin()) - (ungot && last_c != -1 ? 1 : 0);
+	}
+
+	bool is_open() const
+	{
+		return source.is_open();
+	}
+
+	const char * text() const
+	{
+		return source.begin();
+	}
+
+	size_t length() const
+	{
+		return (size_t)(source.end() - source.begin());
+	}
+
+	// Where progress & diagnostics for this input go
+	wostream& log() const
+	{
+		return log_to;
+	}
+
+	void skip_ws()
+	{
+		int c;
+		while (iswspace(c = get()))
+		{
+			// Loop
+		}
+		unget();
+	}
+};
+
+// Base for parse tree nodes
+// These are allocated in the pp_stream's Arena and so have their memory
+// released in bulk along with it - deleting one only runs its destructor
+class arena_node
+{
+public:
+	static void * operator new(size_t n, Arena& arena)
+	{
+		return arena.alloc(n);
+	}
+
+	static void operator delete(void *, Arena&)
+	{
+		// Empty
+	}
+
+	static void operator delete(void *)
+	{
+		// Empty
+	}
+};
+
+// Interned token text
+// Each distinct piece of text is stored once and named by a small integer so
+// nodes share it and comparing names is an integer compare.  A few symbols
+// the code generator looks for are always interned first so their numbers
+// are the same in every table.
+class symbol_table
+{
+	string chars;
+	vector<unsigned int> starts;
+	vector<wstring> wide;
+	vector<unsigned int> slots;
+
+	static inline unsigned int hash(const char * const p, const size_t n)
+	{
+		unsigned int h = 2166136261U;
+		for (size_t i = 0; i != n; ++i)
+			h = (h ^ (unsigned char)p[i]) * 16777619U;
+		return h;
+	}
+
+	void rehash();
+
+public:
+	enum
+	{
+		sym_empty,
+		sym_reserved,
+		sym_DEFAULT,
+		sym_import
+	};
+
+	virtual ~symbol_table()
+	{
+		// Empty
+	}
+
+	symbol_table() :
+		slots(64, 0)
+	{
+		starts.push_back(0);
+		intern("", 0);
+		intern("_", 1);
+		intern("DEFAULT", 7);
+		intern("import", 6);
+	}
+
+	unsigned int intern(const char * const p, const size_t n);
+
+	unsigned int intern(const wstring& w)
+	{
+		const string narrow(w.begin(), w.end());
+		return intern(narrow.data(), narrow.length());
+	}
+
+	const wstring& str(const unsigned int sym) const
+	{
+		return wide[sym];
+	}
+
+	size_t size() const
+	{
+		return wide.size();
+	}
+};
+
+unsigned int symbol_table::intern(const char * const p, const size_t n)
+{
+	const size_t mask = slots.size() - 1;
+
+	for (size_t i = hash(p, n) & mask;; i = (i + 1) & mask)
+	{
+		const unsigned int slot = slots[i];
+
+		if (slot == 0)
+		{
+			const unsigned int sym = (unsigned int)wide.size();
+			chars.append(p, n);
+			starts.push_back((unsigned int)chars.length());
+			wide.push_back(wstring((const unsigned char *)p, (const unsigned char *)p + n));
+			slots[i] = sym + 1;
+
+			// Keep the table no more than half full
+			if (wide.size() * 2 > slots.size())
+				rehash();
+			return sym;
+		}
+
+		const unsigned int sym = slot - 1;
+		if (starts[sym + 1] - starts[sym] == n && memcmp(chars.data() + starts[sym], p, n) == 0)
+			return sym;
+	}
+}
+
+void symbol_table::rehash()
+{
+	vector<unsigned int> old_slots(slots.size() * 2, 0);
+	old_slots.swap(slots);
+
+	const size_t mask = slots.size() - 1;
+	for (unsigned int sym = 0; sym != wide.size(); ++sym)
+	{
+		size_t i = hash(chars.data() + starts[sym], starts[sym + 1] - starts[sym]) & mask;
+		while (slots[i] != 0)
+			i = (i + 1) & mask;
+		slots[i] = sym + 1;
+	}
+}
+
+// Fully qualified names, each a parent's name and one more part
+// Kept for all the things of a token stream so that a thing need only
+// point at its name.  A name is never changed once made: a thing whose
+// name or parents change gets a new one.  Making one is locked as the
+// generate workers name the things of different blocks at once.
+class qname_table
+{
+public:
+	class entry
+	{
+	public:
+		const entry * parent;
+		unsigned int symbol;
+		size_t start;				// Of the last part
+		wstring text;
+	};
+
+private:
+	deque<entry> entries;
+	mutex making;
+
+public:
+	virtual ~qname_table()
+	{
+		// Empty
+	}
+
+	// The name symbol, whose text is own less skip characters, has under
+	// parent
+	const entry * make(const entry * const parent, const unsigned int symbol,
+		const wstring& own, const size_t skip);
+
+	// Forget every name, none of which may still be in use
+	void clear()
+	{
+		entries.clear();
+	}
+};
+
+const qname_table::entry * qname_table::make(const entry * const parent,
+	const unsigned int symbol, const wstring& own, const size_t skip)
+{
+	lock_guard<mutex> hold(making);
+
+	entries.push_back(entry());
+	entry& e = entries.back();
+	e.parent = parent;
+	e.symbol = symbol;
+	if (parent == NULL)
+	{
+		e.start = 0;
+		e.text.assign(own, skip, wstring::npos);
+	}
+	else
+	{
+		e.text.reserve(parent->text.length() + 1 + own.length() - skip);
+		e.text = parent->text;
+		e.text += L'_';
+		e.start = e.text.length();
+		e.text.append(own, skip, wstring::npos);
+	}
+	return &e;
+}
+
+class thing_sequence;
+class block_job;
+class block_cache;
+class token_stream;
+
+class thing : public Pted, public arena_node
+{
+public:
+	enum eType
+	{
+		empty,
+		eof,
+		unquoted_str,
+		quoted_str,
+		number,
+		section_start,
+		section_end,
+		square_bracket_start,
+		square_bracket_end,
+		assign,
+		comma,
+		op
+	};
+
+private:
+	token_stream& tokens;
+	unsigned int token;
+	unsigned int name;
+	Ptr<thing_sequence> section;
+
+	// Not counted - we are part of our parent's sequence so a counted link
+	// back would keep the pair alive for ever
+	const thing * parent;
+
+	// Our fully qualified name when last asked for
+	mutable const qname_table::entry * qname;
+
+	// We came straight after an '=', which has no thing of its own
+	bool assigned;
+
+public:
+	virtual ~thing()
+	{
+		// Empty
+	}
+
+	inline thing(token_stream& toks, const size_t tok);
+
+	inline bool isro() const;
+
+	bool iseof() const
+	{
+		return el_type() == eof;
+	}
+
+	inline eType el_type() const;
+	inline const wstring& el_string() const;
+
+	unsigned int el_symbol() const
+	{
+		return name;
+	}
+
+	inline const int el_number() const;
+	inline int el_line_no() const;
+	inline const wstring& el_origin() const;
+
+	thing_sequence& el_sequence() const
+	{
+		return *section;
+	}
+
+	bool has_sequence() const
+	{
+		return !section.isnull();
+	}
+
+	// Whether we are the value in "name = value"
+	bool el_assigned() const
+	{
+		return assigned;
+	}
+
+	void set_assigned()
+	{
+		assigned = true;
+	}
+
+	token_stream& el_tokens() const
+	{
+		return tokens;
+	}
+
+	size_t el_token() const
+	{
+		return token;
+	}
+
+	inline const qname_table::entry * el_qname_entry() const;
+
+	// Our name qualified by all our parents' names
+	// Built once from the parent's name rather than walking the whole chain
+	// each time
+	const wstring& el_qname() const
+	{
+		return el_qname_entry()->text;
+	}
+
+	// Name of the offset'th parent, qualified by no more than depth names
+	// (0 for all of them)
+	// Every truncated name is a tail of the full one so is cut from that
+	const wstring el_name(int offset = 0, int depth = 0) const
+	{
+		if (offset > 0)
+			return parent == NULL ? wstring() : parent->el_name(offset - 1, depth);
+
+		if (depth <= 0)
+			return el_qname();
+
+		const qname_table::entry * const full = el_qname_entry();
+		const qname_table::entry * top = full;
+		while (--depth > 0 && top->parent != NULL)
+			top = top->parent;
+		return full->text.substr(top->start);
+	}
+
+	inline void fix_reserved(int argno);
+	inline const wstring el_argname() const;
+
+	void set_sequence(thing_sequence * const seq);
+
+	void set_parent(thing * new_parent)
+	{
+		parent = new_parent;
+	}
+};
+
+// The tokens lexed from a pp_stream
+// Kept column-wise in dense arrays rather than one object per token so the
+// parser only touches what it needs.  Token text isn't copied - tokens refer
+// to the source bytes by offset & length.  The parse tree built from the
+// tokens is allocated in our Arena so this must outlive it.
+class token_stream
+{
+	pp_stream& in;
+	const wstring origin_name;
+	Arena nodes;
+	vector<thing *> building;		// Things of the sequences being read
+	qname_table names_made;
+	size_t base;
+	size_t pos;
+	vector<unsigned char> types;
+	vector<int> lines;
+	vector<unsigned int> offsets;
+	vector<unsigned int> names;
+	vector<long> numbers;
+	symbol_table syms;
+	size_t type_counts[thing::op + 1];
+	size_t n_things;				// Made from our tokens, for --stats
+	size_t n_sequences;
+
+	static inline bool isidentifier(const int c)
+	{
+		return isalnum(c) || c == '_';
+	}
+
+	void lex();
+
+public:
+	virtual ~token_stream()
+	{
+		// Empty
+	}
+
+	// origin names the file in errors, if it isn't the one being compiled
+	token_stream(pp_stream& src, const wstring& origin = wstring()) :
+		in(src),
+		origin_name(origin),
+		base(0),
+		pos(0),
+		n_things(0),
+		n_sequences(0)
+	{
+		for (int i = 0; i <= thing::op; ++i)
+			type_counts[i] = 0;
+	}
+
+	// Lex everything up to and including eof
+	void lex_all()
+	{
+		while (types.empty() || types.back() != thing::eof)
+			lex();
+	}
+
+	// Index of the next token, lexing it if we haven't already
+	size_t next()
+	{
+		if (pos == base + types.size())
+			lex();
+		return pos++;
+	}
+
+	// Forget the tokens read so far and the nodes made from them
+	// Nothing may still refer to either; token indices carry on from where
+	// they were
+	void release()
+	{
+		const size_t keep = base + types.size() - pos;
+
+		types.erase(types.begin(), types.end() - keep);
+		lines.erase(lines.begin(), lines.end() - keep);
+		offsets.erase(offsets.begin(), offsets.end() - keep);
+		names.erase(names.begin(), names.end() - keep);
+		numbers.erase(numbers.begin(), numbers.end() - keep);
+		base = pos;
+		nodes.reset();
+		names_made.clear();
+	}
+
+	size_t size() const
+	{
+		return base + types.size();
+	}
+
+	thing::eType type(const size_t i) const
+	{
+		return (thing::eType)types[i - base];
+	}
+
+	int line(const size_t i) const
+	{
+		return lines[i - base];
+	}
+
+	size_t offset(const size_t i) const
+	{
+		return offsets[i - base];
+	}
+
+	unsigned int symbol(const size_t i) const
+	{
+		return names[i - base];
+	}
+
+	long number(const size_t i) const
+	{
+		return numbers[i - base];
+	}
+
+	wostream& log() const
+	{
+		return in.log();
+	}
+
+	const wstring& origin() const
+	{
+		return origin_name;
+	}
+
+	Arena& arena()
+	{
+		return nodes;
+	}
+
+	// Where sequences gather their things as they are read, to then put
+	// them in one array of just the right size
+	// Sequences within a sequence stack theirs on top and take them off
+	// again.
+	vector<thing *>& things_read()
+	{
+		return building;
+	}
+
+	symbol_table& symbols()
+	{
+		return syms;
+	}
+
+	qname_table& qnames()
+	{
+		return names_made;
+	}
+
+	const symbol_table& symbols() const
+	{
+		return syms;
+	}
+
+	// Tokens of the type lexed so far, including any released
+	size_t count(const thing::eType type) const
+	{
+		return type_counts[type];
+	}
+
+	// Count the parse tree's nodes as they are made, released or not
+	void made_thing()
+	{
+		++n_things;
+	}
+
+	void made_sequence()
+	{
+		++n_sequences;
+	}
+
+	size_t things() const
+	{
+		return n_things;
+	}
+
+	size_t sequences() const
+	{
+		return n_sequences;
+	}
+
+	// Add the source of tokens first to last, and whatever lies between
+	// them, to h
+	void hash(content_hash& h, const size_t first, const size_t last) const
+	{
+		const size_t start = offset(first);
+		size_t end = offset(last);
+
+		if (symbol(last) == symbol_table::sym_empty)
+			++end;
+		else
+			end += syms.str(symbol(last)).length();
+		if (end > in.length())
+			end = in.length();
+		h.add(in.text() + start, end - start);
+	}
+};
+
+void token_stream::lex()
+{
+	long numval = 0;
+	thing::eType thing_type;
+
+	in.skip_ws();
+
+	// Set the line_no of this token after skipping whitespace which may
+	// well contain newlines
+	const int line_no = in.line();
+	size_t start = in.offset();
+	size_t len = 0;
+
+	wint_t c = in.get();
+	if (c == WEOF)
+	{
+		thing_type = thing::eof;
+	}
+	else if (c == '"')
+	{
+		thing_type = thing::quoted_str;
+		++start;
+		while ((c = in.get(true)) != '"')
+		{
+			if (c == WEOF)
+				throw hwdc_error(origin_name, line_no, L"Unterminated string");
+			++len;
+		}
+	}
+	else if (isidentifier(c))
+	{
+		thing_type = thing::unquoted_str;
+
+		// Accumulate string
+		for (; isidentifier(c); c = in.get())
+		{
+			++len;
+		}
+		in.unget();
+
+		// Test if this is a valid number and if so then mark as such
+		// At the moment we use strtol for conversion but this might want
+		// to be changed if we want binary numbers too.
+		// Only identifier characters got this far so anything that isn't
+		// led by a digit can't be a number.
+		const char * const p = in.text() + start;
+		if (isdigit((unsigned char)*p))
+		{
+			char buf[64];
+			string big;
+			const char * cstr = buf;
+			char * endptr;
+
+			if (len < sizeof(buf))
+			{
+				memcpy(buf, p, len);
+				buf[len] = '\0';
+			}
+			else
+			{
+				big.assign(p, len);
+				cstr = big.c_str();
+			}
+
+			numval = strtol(cstr, &endptr, 0);
+			// Its a good number if strtol consumes the entire string
+			if ((size_t)(endptr - cstr) == len)
+			{
+				thing_type = thing::number;
+			}
+		}
+	}
+	else
+	{
+		len = 1;
+		switch (c)
+		{
+			case '{':
+				thing_type = thing::section_start;
+				break;
+			case '}':
+				thing_type = thing::section_end;
+				break;
+			case '[':
+				thing_type = thing::square_bracket_start;
+				break;
+			case ']':
+				thing_type = thing::square_bracket_end;
+				break;
+			case '=':
+				thing_type = thing::assign;
+				break;
+			case ',':
+				thing_type = thing::comma;
+				break;
+			default:
+				thing_type = thing::op;
+				break;
+		}
+	}
+
+	// Punctuation is typed by its character so only these have text
+	unsigned int sym = symbol_table::sym_empty;
+	if (thing_type == thing::unquoted_str || thing_type == thing::quoted_str ||
+		thing_type == thing::number || thing_type == thing::op)
+	{
+		sym = syms.intern(in.text() + start, len);
+	}
+
+	++type_counts[thing_type];
+	types.push_back((unsigned char)thing_type);
+	lines.push_back(line_no);
+	offsets.push_back((unsigned int)start);
+	names.push_back(sym);
+	numbers.push_back(numval);
+}
+
+thing::thing(token_stream& toks, const size_t tok) :
+	tokens(toks),
+	token((unsigned int)tok),
+	name(toks.symbol(tok)),
+	parent(NULL),
+	qname(NULL),
+	assigned(false)
+{
+	// Empty
+}
+
+bool thing::isro() const
+{
+	const wstring& strval = el_string();
+	return !strval.empty() && strval[0] == '_';
+}
+
+thing::eType thing::el_type() const
+{
+	return tokens.type(token);
+}
+
+const wstring& thing::el_string() const
+{
+	return tokens.symbols().str(name);
+}
+
+const int thing::el_number() const
+{
+	return tokens.number(token);
+}
+
+int thing::el_line_no() const
+{
+	return tokens.line(token);
+}
+
+const wstring& thing::el_origin() const
+{
+	return tokens.origin();
+}
+
+// Our qualified name, made again if our name or any parent has changed
+// since it was last made
+const qname_table::entry * thing::el_qname_entry() const
+{
+	const qname_table::entry * const pname = parent == NULL ? NULL : parent->el_qname_entry();
+
+	if (qname == NULL || qname->parent != pname || qname->symbol != name)
+		qname = tokens.qnames().make(pname, name, el_string(), isro() ? 1 : 0);
+	return qname;
+}
+
+void thing::fix_reserved(int argno)
+{
+	if (name == symbol_table::sym_reserved)
+	{
+		name = tokens.symbols().intern(L"_Reserved" + itowstring(argno));
+	}
+}
+
+const wstring thing::el_argname() const
+{
+	const wstring& strval = el_string();
+	const size_t wlen = strval.length();
+	wstring x;
+	x.reserve(wlen + 1);
+	x += L'_';
+	for (size_t i = 0; i != wlen; ++i)
+	{
+		x += towlower(strval[i]);
+	}
+	return x;
+}
+
+class syntax_error : public hwdc_error
+{
+	// An assigned thing is out of place because of the '=' before it, which
+	// has no thing of its own, so that is what gets the blame
+	static size_t
+	blamed(const thing& bad_thing)
+	{
+		return bad_thing.el_token() - (bad_thing.el_assigned() ? 1 : 0);
+	}
+
+public:
+	virtual ~syntax_error()
+	{
+		// Empty
+	}
+
+	syntax_error(const thing& bad_thing) :
+		hwdc_error(bad_thing.el_origin(), bad_thing.el_tokens().line(blamed(bad_thing)),
+			wstring(L"Syntax error near thing: ") + bad_thing.el_tokens().symbols().str(
+				bad_thing.el_tokens().symbol(blamed(bad_thing))))
+	{
+		// Empty
+	}
+};
+
+class thing_sequence: public Pted, public arena_node, public PtrList<thing>
+{
+	// Square bracket sequences read so far
+	int sb_count;
+
+	// The token that ended us once we've been read
+	size_t end_tok;
+
+	// An '=' has been read, its value not yet
+	bool assigning;
+
+public:
+	virtual ~thing_sequence()
+	{
+		// Empty
+	}
+
+	thing_sequence() :
+		sb_count(0),
+		end_tok(0),
+		assigning(false)
+	{
+		// Empty
+	}
+
+	thing_sequence(token_stream& in, const thing::eType expected_end = thing::eof);
+	bool read_next(token_stream& in, const thing::eType expected_end, thing * const last,
+		Ptr<thing>& t);
+	bool read_thing(token_stream& in, const thing::eType expected_end);
+	bool block_complete() const;
+
+	void clear()
+	{
+		empty();
+		sb_count = 0;
+		assigning = false;
+	}
+
+	virtual void generate_c(out_buffer& os, thing * parent = NULL, const int argno = 0);
+	void generate_blocks(out_buffer& os, const unsigned int n_threads,
+		block_cache * const cache = NULL);
+	void generate_jobs(std::PList<block_job>& jobs, const vector<size_t>& starts,
+		unsigned int n_threads, block_cache * const cache = NULL);
+	void generate_range(out_buffer& os, const size_t first, const size_t last,
+		thing * parent = NULL, const int argno = 0);
+	bool split_blocks(vector<size_t>& starts) const;
+	string block_key(const size_t first, const size_t last) const;
+
+	size_t end_token() const
+	{
+		return end_tok;
+	}
+
+	thing& extract(size_t i)
+	{
+		if (i >= len())
+		{
+			throw syntax_error(*(*this)[i - 1]);
+		}
+		return *(*this)[i];
+	}
+
+	virtual wstring sb_val() const
+	{
+		return wstring();
+	}
+};
+
+class square_bracket_sequence : public thing_sequence
+{
+	token_stream& tokens;
+	size_t start_tok;			// The '['
+	int val_shift;
+	int field_shift;
+	int mask;
+
+public:
+	virtual ~square_bracket_sequence()
+	{
+		// Empty
+	}
+	square_bracket_sequence(token_stream& in, const size_t start) :
+		thing_sequence(in, thing::square_bracket_end),
+		tokens(in),
+		start_tok(start),
+		val_shift(0),
+		field_shift(0),
+		mask(0)
+	{
+		// Empty
+	}
+
+	virtual void generate_c(out_buffer& os, thing * parent = NULL, const int argno = 0);
+
+	// Field position from [shift, width, value shift], width defaulting to
+	// one bit and the value shift to none
+	void layout(int& shift, int& width, int& vshift) const;
+
+	virtual wstring sb_val() const
+	{
+		return wstring (L"(((x) >> ") +
+			itowstring(val_shift) + wstring(L") & 0x") + itowstring(mask, 16) + wstring(L")");
+	}
+};
+
+class section_sequence : public thing_sequence
+{
+public:
+	virtual ~section_sequence()
+	{
+		// Empty
+	}
+	section_sequence(token_stream& in) :
+		thing_sequence(in, thing::section_end)
+	{
+		// Empty
+	}
+};
+
+
+// Read the whole sequence
+// Our things are gathered on the stream's stack and then put in an array
+// from its arena, so reading allocates nothing outside the arena
+thing_sequence::thing_sequence(token_stream& in, const thing::eType expected_end) :
+	sb_count(0),
+	end_tok(0),
+	assigning(false)
+{
+	vector<thing *>& read = in.things_read();
+	const size_t first = read.size();
+
+	in.made_sequence();
+	try
+	{
+		Ptr<thing> t;
+		while (read_next(in, expected_end, read.size() != first ? read.back() : NULL, t))
+		{
+			if (!t.isnull())
+				read.push_back(t.release());
+		}
+	}
+	catch (...)
+	{
+		while (read.size() != first)
+		{
+			read.back()->DecReferenceCount();
+			read.pop_back();
+		}
+		throw;
+	}
+
+	adopt(read.data() + first, read.size() - first, in.arena());
+	read.resize(first);
+}
+
+// Read the next thing in the sequence, along with the sequence it starts
+// if any, last being the thing before
+// An '=' makes no thing, the thing after it being marked as assigned
+// instead, and nor do the commas in square brackets, which are read from
+// the tokens by layout, so t can be left null
+// Returns false at the end of the sequence
+bool thing_sequence::read_next(token_stream& in, const thing::eType expected_end,
+	thing * const last, Ptr<thing>& t)
+{
+	const size_t tok = in.next();
+	thing::eType t_type = in.type(tok);
+
+	t.null();
+
+	switch (t_type)
+	{
+		case thing::square_bracket_start:
+		{
+			// Anonymous fields are named after their argument position
+			// now so names are fixed once parsed
+			++sb_count;
+			if (last != NULL)
+				last->fix_reserved(sb_count);
+
+			t = new (in.arena()) thing(in, tok);
+			t->set_sequence(new (in.arena()) square_bracket_sequence(in, tok));
+			break;
+		}
+		case thing::section_start:
+		{
+			t = new (in.arena()) thing(in, tok);
+			t->set_sequence(new (in.arena()) section_sequence(in));
+			break;
+		}
+
+		case thing::assign:
+			if (assigning)
+				throw syntax_error(thing(in, tok));
+			assigning = true;
+			return true;
+
+		case thing::comma:
+			if (expected_end == thing::square_bracket_end)
+				return true;
+			t = new (in.arena()) thing(in, tok);
+			break;
+
+		case thing::eof:
+		case thing::section_end:
+		case thing::square_bracket_end:
+			if (t_type != expected_end)
+			{
+				in.log() << L"**** bad brackets ***\n";
+				throw syntax_error(thing(in, tok));
+			}
+			// An '=' with nothing after it
+			if (assigning)
+				throw syntax_error(thing(in, tok - 1));
+			end_tok = tok;
+			return false;
+
+		default:
+			t = new (in.arena()) thing(in, tok);
+			break;
+	}
+
+	in.made_thing();
+	if (assigning)
+	{
+		t->set_assigned();
+		assigning = false;
+	}
+	return true;
+}
+
+// As read_next, adding what is read to us
+bool thing_sequence::read_thing(token_stream& in, const thing::eType expected_end)
+{
+	Ptr<thing> t;
+
+	if (!read_next(in, expected_end, len() != 0 ? (*this)[len() - 1] : NULL, t))
+		return false;
+	if (!t.isnull())
+		*this << move(t);
+	return true;
+}
+
+// Whether we hold a whole top level block, or have seen enough of one to
+// know generate_c will reject it
+bool thing_sequence::block_complete() const
+{
+	switch (len())
+	{
+		case 0:
+			return false;
+		case 1:
+			return (*this)[0]->el_type() != thing::unquoted_str;
+		case 2:
+			return (*this)[1]->el_assigned() ||
+				(*this)[1]->el_type() != thing::square_bracket_start;
+		default:
+			return true;
+	}
+}
+
+// Whether the top level things at i are an import: the word import then
+// the name of the file in quotes
+static bool
+is_import(const thing_sequence& seq, const size_t i)
+{
+	return i + 1 < seq.len() && seq[i]->el_type() == thing::unquoted_str &&
+		seq[i]->el_symbol() == symbol_table::sym_import &&
+		seq[i + 1]->el_type() == thing::quoted_str && !seq[i + 1]->el_assigned();
+}
+
+// Where an import of name from the file from is found: as it is if
+// absolute, otherwise relative to from's directory
+static filename_str
+import_path(const filename_str& from, const wstring& name)
+{
+	const filename_str path(name.begin(), name.end());
+	if (!path.empty() && (path[0] == '/' || path[0] == '\\' ||
+		(path.length() > 1 && path[1] == ':')))
+	{
+		return path;
+	}
+
+	size_t dir_end = 0;
+	for (size_t i = 0; i != from.length(); ++i)
+	{
+		if (from[i] == '/' || from[i] == '\\')
+			dir_end = i + 1;
+	}
+	return from.substr(0, dir_end) + path;
+}
+
+// The one name for a file however it is reached, or path as it is if that
+// can't be found
+static filename_str
+canonical_path(const filename_str& path)
+{
+#if IS_UNIX
+	char * const real = realpath(path.c_str(), NULL);
+	if (real == NULL)
+		return path;
+	const filename_str canon(real);
+	free(real);
+	return canon;
+#else
+	wchar_t buf[MAX_PATH];
+	const DWORD n = GetFullPathNameW(path.c_str(), MAX_PATH, buf, NULL);
+	if (n == 0 || n >= MAX_PATH)
+		return path;
+	return filename_str(buf, n);
+#endif
+}
+
+// An input file and what was parsed from it
+// Imported files are parsed on worker threads so they keep their progress
+// messages in notes, and name themselves in errors
+class source_file : public Pted
+{
+public:
+	const filename_str name;
+	wostringstream notes;
+	pp_stream src;
+	token_stream tokens;
+	Ptr<thing_sequence> things;
+	vector<size_t> import_at;		// Where each import is in things
+	vector<size_t> imports;			// And which source it names
+	Ptr1<hwdc_error> error;
+
+	virtual ~source_file()
+	{
+		// Empty
+	}
+
+	// log is where progress goes for the file being compiled, NULL for an
+	// imported one
+	source_file(const filename_str& file, wostream * const log, const bool may_map) :
+		name(file),
+		src(name.c_str(), log != NULL ? *log : notes, may_map),
+		tokens(src, log != NULL ? wstring() : wstring(file.begin(), file.end()))
+	{
+		// Empty
+	}
+
+	void parse();
+};
+
+// Lex and parse everything, noting where the imports are
+// Imports are only looked for at the top level, and not as the value of a
+// constant
+void source_file::parse()
+{
+	tokens.lex_all();
+	things = new (tokens.arena()) thing_sequence(tokens);
+
+	const thing_sequence& seq = *things;
+	for (size_t i = 0; i < seq.len(); ++i)
+	{
+		if (is_import(seq, i))
+		{
+			import_at.push_back(i);
+			++i;
+		}
+		else if (i + 1 < seq.len() && seq[i + 1]->el_assigned())
+		{
+			++i;
+		}
+	}
+}
+
+// Every file a compile reads: the one given and all it imports, each read
+// and parsed once however many files import it
+// Files can be read again, after which the next parse parses only them
+// and whatever they newly import, keeping the rest as they were.  Kept
+// files' things point into their text, so files that may be rewritten
+// while kept are read into memory rather than mapped.
+class source_set
+{
+	PtrList<source_file> files;
+	unordered_map<filename_str, size_t> index;		// By canonical path
+	vector<char> reached;							// By the last parse
+	wostream& log_to;
+	const bool may_map;
+
+	void splice_file(const size_t i, thing_sequence& seq, vector<char>& spliced) const;
+
+public:
+	virtual ~source_set()
+	{
+		// Empty
+	}
+
+	source_set(const filename_t main_file, wostream& log, const bool map = true) :
+		log_to(log),
+		may_map(map)
+	{
+		const filename_str name(main_file);
+		files << new source_file(name, &log, may_map);
+		index[canonical_path(name)] = 0;
+	}
+
+	size_t len() const
+	{
+		return files.len();
+	}
+
+	source_file& operator[] (const size_t i) const
+	{
+		return *files[i];
+	}
+
+	size_t add(const source_file& from, const thing& name);
+	void reload(const size_t i);
+	void report(const size_t i);
+	void parse(const unsigned int n_threads);
+	void splice(thing_sequence& seq) const;
+	void imported(vector<filename_str>& names) const;
+};
+
+// The source imported by the file from as name, read and added if it is the
+// first import of that file
+size_t source_set::add(const source_file& from, const thing& name)
+{
+	const filename_str path = import_path(from.name, name.el_string());
+	const filename_str canon = canonical_path(path);
+
+	const unordered_map<filename_str, size_t>::const_iterator found = index.find(canon);
+	if (found != index.end())
+		return found->second;
+
+	Ptr<source_file> file = new source_file(path, NULL, may_map);
+	if (!file->src.is_open())
+	{
+		throw hwdc_error(name.el_origin(), name.el_line_no(),
+			L"Cannot open import \"" + name.el_string() + L"\"");
+	}
+
+	const size_t i = files.len();
+	files << file;
+	index[canon] = i;
+	return i;
+}
+
+// Read source i again, as it has changed
+// An import that has gone is only an error if it is still imported
+void source_set::reload(const size_t i)
+{
+	Ptr<source_file> file = new source_file(files[i]->name, i == 0 ? &log_to : NULL, may_map);
+	if (i != 0 && !file->src.is_open())
+	{
+		file->error = new hwdc_error(0, L"Cannot open import \"" +
+			wstring(file->name.begin(), file->name.end()) + L"\"");
+	}
+	files.set(i, file);
+}
+
+// Pass on what source i had to say and any error it met
+void source_set::report(const size_t i)
+{
+	source_file& file = *files[i];
+
+	log_to << file.notes.str();
+	file.notes.str(wstring());
+	if (!file.error.isnull())
+		throw hwdc_error(*file.error);
+}
+
+static void
+parse_worker(const source_set * const sources, const vector<size_t> * const todo,
+	atomic<size_t> * const next_file)
+{
+	size_t i;
+
+	while ((i = (*next_file)++) < todo->size())
+	{
+		source_file& file = (*sources)[(*todo)[i]];
+		try
+		{
+			file.parse();
+		}
+		catch (hwdc_error& err)
+		{
+			file.error = new hwdc_error(err);
+		}
+		catch (std::exception& err)
+		{
+			file.error = new hwdc_error(err);
+		}
+		catch (...)
+		{
+			file.error = new hwdc_error(0, L"Unknown error");
+		}
+	}
+}
+
+// Parse the file being compiled then everything it imports, a round at a
+// time: each round is the files first reached from the round before, those
+// not already parsed being parsed on up to n_threads threads
+void source_set::parse(const unsigned int n_threads)
+{
+	vector<size_t> round(1, 0);
+
+	reached.assign(files.len(), 0);
+	reached[0] = 1;
+	while (!round.empty())
+	{
+		vector<size_t> todo;
+		for (size_t i = 0; i != round.size(); ++i)
+		{
+			if (files[round[i]]->things.isnull() && files[round[i]]->error.isnull())
+				todo.push_back(round[i]);
+		}
+
+		const size_t n = n_threads < todo.size() ? n_threads : todo.size();
+		atomic<size_t> next_file(0);
+		vector<thread> threads;
+		for (size_t i = 1; i < n; ++i)
+			threads.push_back(thread(parse_worker, this, &todo, &next_file));
+		parse_worker(this, &todo, &next_file);
+		for (size_t i = 0; i != threads.size(); ++i)
+			threads[i].join();
+
+		vector<size_t> next;
+		for (size_t i = 0; i != round.size(); ++i)
+		{
+			report(round[i]);
+
+			source_file& file = *files[round[i]];
+			for (size_t j = file.imports.size(); j != file.import_at.size(); ++j)
+				file.imports.push_back(add(file, *(*file.things)[file.import_at[j] + 1]));
+
+			reached.resize(files.len(), 0);
+			for (size_t j = 0; j != file.imports.size(); ++j)
+			{
+				if (!reached[file.imports[j]])
+				{
+					reached[file.imports[j]] = 1;
+					next.push_back(file.imports[j]);
+				}
+			}
+		}
+		round.swap(next);
+	}
+}
+
+// The files imported, directly or not, by the last parse or if none all
+// that have been read
+void source_set::imported(vector<filename_str>& names) const
+{
+	names.clear();
+	for (size_t i = 1; i != files.len(); ++i)
+	{
+		if (reached.empty() || reached[i])
+			names.push_back(files[i]->name);
+	}
+}
+
+// Append the top level things of the file being compiled to seq, with each
+// import replaced by the things of the file it names
+// Only the first import of a file brings its things in, so files may be
+// imported more than once or import each other
+void source_set::splice(thing_sequence& seq) const
+{
+	vector<char> spliced(files.len(), 0);
+	splice_file(0, seq, spliced);
+}
+
+void source_set::splice_file(const size_t i, thing_sequence& seq, vector<char>& spliced) const
+{
+	const source_file& file = *files[i];
+	const thing_sequence& things = *file.things;
+	size_t next_import = 0;
+
+	spliced[i] = 1;
+	for (size_t j = 0; j != things.len(); ++j)
+	{
+		if (next_import != file.import_at.size() && j == file.import_at[next_import])
+		{
+			const size_t imported = file.imports[next_import++];
+			if (!spliced[imported])
+				splice_file(imported, seq, spliced);
+			++j;
+		}
+		else
+		{
+			seq << things[j];
+		}
+	}
+}
+
+// Parse and generate the top level sequence of source i one block at a
+// time, releasing each block as soon as its output is made
+// Memory use is then bounded by the biggest block rather than the whole
+// input.  Blocks ahead of a syntax error will have been output by the time
+// it is found.  Imports are streamed where they are, the first time only.
+void
+generate_stream(source_set& sources, const size_t i, out_buffer& os)
+{
+	token_stream& in = sources[i].tokens;
+	thing_sequence block;
+
+	// The one top level sequence, however many blocks pass through it
+	in.made_sequence();
+	while (block.read_thing(in, thing::eof))
+	{
+		if (block.block_complete())
+		{
+			if (is_import(block, 0))
+			{
+				const size_t n_sources = sources.len();
+				const size_t imported = sources.add(sources[i], *block[1]);
+				if (sources.len() != n_sources)
+				{
+					sources.report(imported);
+					generate_stream(sources, imported, os);
+				}
+			}
+			else
+			{
+				block.generate_c(os, NULL);
+			}
+			os.flush();
+			block.clear();
+			in.release();
+		}
+	}
+
+	// Whatever is left of a truncated block
+	block.generate_c(os, NULL);
+}
+
+
+void generate_rmk_hdr(out_buffer& os, const thing &parent, const PtrList<thing> &bthings, const wchar_t * rmk)
+{
+	os << L"#define " << parent.el_qname() << rmk;
+	bool arg1 = true;
+	const size_t blen = bthings.len();
+	for (size_t i = 0; i != blen; ++i)
+	{
+		if (!bthings[i]->isro())
+		{
+			if (!arg1)
+				os << L',';
+			arg1 = false;
+			os << bthings[i]->el_argname();
+		}
+	}
+	os << L") (\\\n\t((";
+}
+
+// Most fields a single <register>_UPDATE can set
+static const int max_update_fields = 32;
+
+// Support for --update's and --shadow's macros, emitted once at the top of
+// each header that has them
+// <register>_UPDATE is one macro per register, handing its fields on to
+// a chain of _HWD_Mn and _HWD_Vn, n the number of arguments, that ORs
+// together their masks and values
+static void
+generate_c_support(out_buffer& os)
+{
+	const int max_args = max_update_fields * 2;
+
+	os << "#ifndef HWD_C_SUPPORT\n"
+		"#define HWD_C_SUPPORT\n"
+		"\n"
+		"/* <register>_UPDATE(p, FIELD, VALUE, ...) sets any of the register's\n"
+		"   fields in *p with one read and one write.  VALUE is any of the field's\n"
+		"   values, VAL(x) or OF(x). */\n"
+		"#define _HWD_M(r, f, v) _##r##_##f##_MASK\n"
+		"#define _HWD_V(r, f, v) (((r##_##f##_##v) << _##r##_##f##_SHIFT) & _##r##_##f##_MASK)\n"
+		"#define _HWD_M2(r, f, v) _HWD_M(r, f, v)\n"
+		"#define _HWD_V2(r, f, v) _HWD_V(r, f, v)\n";
+	for (int n = 4; n <= max_args; n += 2)
+	{
+		os << "#define _HWD_M" << n << "(r, f, v, ...) _HWD_M(r, f, v) | _HWD_M" << n - 2 <<
+			"(r, __VA_ARGS__)\n";
+		os << "#define _HWD_V" << n << "(r, f, v, ...) _HWD_V(r, f, v) | _HWD_V" << n - 2 <<
+			"(r, __VA_ARGS__)\n";
+	}
+
+	os << "#define _HWD_N(...) _HWD_N_(__VA_ARGS__";
+	for (int n = max_args; n > 0; --n)
+		os << ", " << n;
+	os << ")\n#define _HWD_N_(";
+	for (int n = 1; n <= max_args; ++n)
+		os << "_" << n << ", ";
+	os << "n, ...) n\n"
+		"#define _HWD_U(n, r, p, ...) _HWD_U_(n, r, p, __VA_ARGS__)\n"
+		"#define _HWD_U_(n, r, p, ...) \\\n"
+		"\t(*(p) = (*(p) & ~(_HWD_M##n(r, __VA_ARGS__))) | (_HWD_V##n(r, __VA_ARGS__)))\n"
+		"#define _HWD_UPDATE(r, p, ...) _HWD_U(_HWD_N(__VA_ARGS__), r, p, __VA_ARGS__)\n"
+		"\n"
+		"#endif\n"
+		"\n";
+}
+
+void thing_sequence::generate_c(out_buffer& os, thing * parent, const int argno)
+{
+	generate_range(os, 0, len(), parent, argno);
+}
+
+void thing_sequence::generate_range(out_buffer& os, const size_t first, const size_t last,
+	thing * parent, const int argno)
+{
+	size_t i = first;
+	int sb_count = 0;
+	bool seen_default = false;
+	bool all_ro = true;
+	PtrList<thing> bthings;
+
+	while (i < last)
+	{
+		thing& name = *(*this)[i++];
+		name.set_parent(parent);
+
+		// Start with unquoted-string
+		// Numbers are valid unless prefix is empty
+		if (!(name.el_type() == thing::unquoted_str ||
+			(name.el_type() == thing::number && parent != NULL)) || name.el_assigned())
+		{
+			throw syntax_error(name);
+		}
+
+		// Various things valid next
+		thing& el = extract(i++);
+
+		if (el.el_assigned())
+		{
+			// All sorts of things possible
+			os << L"#define " << name.el_qname() << L" " << el.el_string() << L"\n";
+			if (argno > 0)
+			{
+				os << L"#define _" << name.el_name(2) << L"_arg" << argno <<
+					L"_" << name.el_name(0, 2) <<
+					L" " << el.el_string() << L"\n";
+			}
+
+			if (name.el_symbol() == symbol_table::sym_DEFAULT)
+				seen_default = true;
+
+			continue;
+		}
+
+		switch (el.el_type())
+		{
+			case thing::square_bracket_start:
+			{
+				++sb_count;
+
+				el.el_sequence().generate_c(os, &name, sb_count);
+
+				// We expect section start next
+				thing& el2 = extract(i++);
+				if (el2.el_type() != thing::section_start)
+					throw syntax_error(el2);
+
+				el2.el_sequence().generate_c(os, &name, sb_count);
+				os << L"\n";
+
+				bthings << &name;
+				if (!name.isro())
+					all_ro = false;
+
+				break;
+			}
+
+			case thing::section_start:
+			{
+				el.el_sequence().generate_c(os, &name);
+				break;
+			}
+
+			default:
+				throw syntax_error(el);
+		}
+	}
+
+	if (argno > 0)
+	{
+		if (!seen_default)
+		{
+			os << "#define " << parent->el_qname() << L"_DEFAULT 0\n";
+		}
+	}
+
+	if (bthings.len() != 0)
+	{
+		const size_t blen = bthings.len();
+
+		if (!all_ro)
+		{
+			generate_rmk_hdr(os, *parent, bthings, L"_RMK(");
+			for (size_t i = 0; i != blen; ++i)
+			{
+				if (i != 0)
+					os << L" | \\\n\t((";
+				if (bthings[i]->isro())
+					os << bthings[i]->el_qname() << L"_DEFAULT";
+				else
+					os << bthings[i]->el_argname();
+	
+				os << L") << _" << bthings[i]->el_qname() << L"_SHIFT)";
+			}
+			os << L")\n";
+	
+			generate_rmk_hdr(os, *parent, bthings, L"_RMKS(");
+			for (size_t i = 0; i != blen; ++i)
+			{
+				if (i != 0)
+					os << L" | \\\n\t((";
+	
+				if (bthings[i]->isro())
+					os << bthings[i]->el_qname() << L"_DEFAULT";
+				else
+					os << L'_' << parent->el_qname() << L"_arg" << (i + 1) << L"_##" <<
+						 bthings[i]->el_argname();
+				os << L") << _" << bthings[i]->el_qname() << L"_SHIFT)";
+			}
+			os << L")\n";
+		}
+
+		os << L"#define " << parent->el_qname() << L"_DEFAULT (\\\n\t(";
+		for (size_t i = 0; i != blen; ++i)
+		{
+			if (i != 0)
+				os << L" | \\\n\t(";
+
+			os << bthings[i]->el_qname() << L"_DEFAULT << _" << bthings[i]->el_qname() << "_SHIFT)";
+		}
+		os << L")\n\n";
+
+
+	}
+}
+
+void square_bracket_sequence::layout(int& shift, int& width, int& vshift) const
+{
+	size_t j = 0;
+	int vals[3];
+
+	vals[0] = 0;
+	vals[1] = 1;
+	vals[2] = 0;
+
+	for (size_t i = start_tok + 1; i < end_token(); ++i)
+	{
+		switch (tokens.type(i))
+		{
+			case thing::comma:
+				if (++j >= 3)
+					throw syntax_error(thing(tokens, i));
+				break;
+			case thing::number:
+				vals[j] = (int)tokens.number(i);
+				break;
+			default:
+				throw syntax_error(thing(tokens, i));
+		}
+	}
+
+	shift = vals[0];
+	width = vals[1];
+	vshift = vals[2];
+}
+
+void square_bracket_sequence::generate_c(out_buffer& os, thing * const parent, const int argno)
+{
+	int width;
+
+	layout(field_shift, width, val_shift);
+	mask = width == 32 ? 0xffffffff : (1U << width) - 1;
+
+	os << L"#define _" << parent->el_qname() << L"_SHIFT " << field_shift << L"\n";
+	os << L"#define _" << parent->el_qname() << L"_MASK 0x" << itowstring(mask << field_shift, 16) << L"\n";
+
+	if (!parent->isro())
+	{
+		os << "#define " << parent->el_qname() << L"_OF(x) (x)\n";
+		os << L"#define _" << parent->el_name(1) << L"_arg" << argno <<
+			L"_" << parent->el_name(0, 1) << L"_OF(x) (x)\n";
+	
+		os << "#define " << parent->el_qname() << L"_VAL(x) " << sb_val() << L"\n";
+		os << L"#define _" << parent->el_name(1) << L"_arg" << argno <<
+			L"_" << parent->el_name(0, 1) << L"_VAL(x) " << sb_val() << L"\n";;
+	}
+
+
+}
+
+
+
+// Split a top level sequence into its blocks, giving the index each starts
+// at plus one past the end
+// Only sequences of "name { ... }" sections and "name = value" assignments
+// split this way - they generate independently of each other
+bool thing_sequence::split_blocks(vector<size_t>& starts) const
+{
+	size_t i = 0;
+
+	starts.clear();
+	while (i < len())
+	{
+		starts.push_back(i);
+		if (i + 1 >= len())
+			return false;
+
+		const thing& name = *(*this)[i];
+		if (name.el_type() != thing::unquoted_str || name.el_assigned())
+			return false;
+
+		const thing& next = *(*this)[i + 1];
+		if (!next.el_assigned() && next.el_type() != thing::section_start)
+			return false;
+		i += 2;
+	}
+	starts.push_back(i);
+	return true;
+}
+
+// A hash of the tokens of the top level block first..last, or nothing if
+// it doesn't all come from one file
+string thing_sequence::block_key(const size_t first, const size_t last) const
+{
+	const thing& start = *(*this)[first];
+	const thing& end = *(*this)[last - 1];
+
+	if (&start.el_tokens() != &end.el_tokens())
+		return string();
+
+	content_hash h;
+	start.el_tokens().hash(h, start.el_token(),
+		end.has_sequence() ? end.el_sequence().end_token() : end.el_token());
+	return h.hex();
+}
+
+// The macros generated for top level blocks, by block_key
+// A block's macros depend on nothing but its own tokens so a block seen
+// before needn't be generated again.  Only the blocks of the latest
+// generate are kept.
+class block_cache
+{
+	unordered_map<string, string> blocks;
+	unordered_map<string, string> latest;
+
+public:
+	virtual ~block_cache()
+	{
+		// Empty
+	}
+
+	// The block's macros if we have them, kept for after the next sweep,
+	// otherwise NULL
+	const string * take(const string& key)
+	{
+		unordered_map<string, string>::iterator found = latest.find(key);
+		if (found != latest.end())
+			return &found->second;
+
+		found = blocks.find(key);
+		if (found == blocks.end())
+			return NULL;
+
+		string& text = latest[key];
+		text.swap(found->second);
+		blocks.erase(found);
+		return &text;
+	}
+
+	void add(const string& key, const string& text)
+	{
+		latest[key] = text;
+	}
+
+	// Forget all but what was added since the last sweep
+	void sweep()
+	{
+		blocks.swap(latest);
+		latest.clear();
+	}
+
+	void load(const filename_t filename);
+	void save(const filename_str& filename) const;
+};
+
+// Read what save wrote, if there is anything, stopping at anything that
+// doesn't look right
+// Each block is its 16 character key, the length of its macros as 8 bytes
+// little end first, then the macros.
+void block_cache::load(const filename_t filename)
+{
+	mapped_file in(filename);
+	const char * p = in.begin();
+	const char * const end = in.end();
+
+	while ((size_t)(end - p) >= 16 + 8)
+	{
+		const string key(p, 16);
+		p += 16;
+
+		unsigned long long n = 0;
+		for (int i = 0; i != 8; ++i)
+			n |= (unsigned long long)(unsigned char)p[i] << (8 * i);
+		p += 8;
+		if (n > (unsigned long long)(end - p))
+			break;
+
+		blocks[key].assign(p, (size_t)n);
+		p += n;
+	}
+}
+
+// Write out the blocks kept by the last sweep
+// Replaces filename as replace_file does, but a piece at a time rather
+// than making a copy of everything first
+void block_cache::save(const filename_str& filename) const
+{
+	const filename_str tmpname = temp_file_name(filename);
+	out_buffer os;
+
+	os.open(tmpname.c_str());
+	for (unordered_map<string, string>::const_iterator i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		if (i->first.length() != 16)
+			continue;
+
+		const unsigned long long n = i->second.length();
+		char len[8];
+		for (int j = 0; j != 8; ++j)
+			len[j] = (char)(n >> (8 * j));
+		os << i->first << string(len, sizeof(len)) << i->second;
+	}
+	os.close();
+	move_into_place(tmpname, filename);
+}
+
+// One top level block of a parallel generate
+class block_job
+{
+public:
+	size_t first;
+	size_t last;
+	string key;
+	const string * cached;
+	out_buffer out;
+	Ptr1<hwdc_error> error;
+
+	virtual ~block_job()
+	{
+		// Empty
+	}
+
+	block_job(const size_t f, const size_t l) :
+		first(f),
+		last(l),
+		cached(NULL)
+	{
+		// Empty
+	}
+
+	// The block's macros, generated or not
+	const string& text() const
+	{
+		return cached != NULL ? *cached : out.str();
+	}
+};
+
+static void
+generate_worker(thing_sequence * const seq, PList<block_job> * const jobs, atomic<size_t> * const next_job)
+{
+	size_t i;
+
+	while ((i = (*next_job)++) < jobs->len())
+	{
+		block_job& job = *(*jobs)[i];
+		if (job.cached != NULL)
+			continue;
+		try
+		{
+			seq->generate_range(job.out, job.first, job.last);
+		}
+		catch (hwdc_error& err)
+		{
+			job.error = new hwdc_error(err);
+		}
+		catch (std::exception& err)
+		{
+			job.error = new hwdc_error(err);
+		}
+		catch (...)
+		{
+			job.error = new hwdc_error(0, L"Unknown error");
+		}
+	}
+}
+
+// Generate a top level sequence using up to n_threads threads
+// Each top level block is generated into a buffer of its own and the
+// buffers written out in order, so the output is just as if generated one
+// block after another.  That includes giving up after the output from the
+// first block with an error.
+// With a cache, blocks it has are taken from it rather than generated
+// whatever the threads.
+void thing_sequence::generate_blocks(out_buffer& os, unsigned int n_threads,
+	block_cache * const cache)
+{
+	vector<size_t> starts;
+
+	if ((cache == NULL && n_threads <= 1) || !split_blocks(starts) ||
+		(cache == NULL && starts.size() <= 2))
+	{
+		generate_c(os, NULL);
+		return;
+	}
+
+	// PList on its own would name our PtrList's private base
+	std::PList<block_job> jobs;
+	generate_jobs(jobs, starts, n_threads, cache);
+
+	for (size_t i = 0; i != jobs.len(); ++i)
+	{
+		os << jobs[i]->text();
+		if (!jobs[i]->error.isnull())
+		{
+			const hwdc_error err(*jobs[i]->error);
+			jobs.deleteall();
+			throw err;
+		}
+	}
+	jobs.deleteall();
+}
+
+// Generate each top level block, as split by split_blocks, into a job of
+// its own using up to n_threads threads
+// Errors are left in each job for the caller to deal with in order.
+// Blocks are looked for in cache, if any, and those made added to it.
+void thing_sequence::generate_jobs(std::PList<block_job>& jobs, const vector<size_t>& starts,
+	unsigned int n_threads, block_cache * const cache)
+{
+	for (size_t i = 0; i + 1 < starts.size(); ++i)
+	{
+		block_job * const job = new block_job(starts[i], starts[i + 1]);
+		jobs << job;
+		if (cache == NULL || (job->key = block_key(job->first, job->last)).empty())
+			continue;
+
+		job->cached = cache->take(job->key);
+	}
+
+	if (n_threads > jobs.len())
+		n_threads = (unsigned int)jobs.len();
+
+	atomic<size_t> next_job(0);
+	vector<thread> threads;
+	try
+	{
+		for (unsigned int i = 1; i < n_threads; ++i)
+			threads.push_back(thread(generate_worker, this, &jobs, &next_job));
+		generate_worker(this, &jobs, &next_job);
+	}
+	catch (...)
+	{
+		// Stop handing out blocks and wait for whoever has one
+		next_job = jobs.len();
+		for (size_t i = 0; i != threads.size(); ++i)
+			threads[i].join();
+		jobs.deleteall();
+		throw;
+	}
+	for (size_t i = 0; i != threads.size(); ++i)
+		threads[i].join();
+
+	if (cache != NULL)
+	{
+		for (size_t i = 0; i != jobs.len(); ++i)
+		{
+			if (!jobs[i]->key.empty() && jobs[i]->cached == NULL && jobs[i]->error.isnull())
+				cache->add(jobs[i]->key, jobs[i]->out.str());
+		}
+	}
+}
+
+void thing::set_sequence(thing_sequence * const seq)
+{
+	section = seq;
+}
+
+// The registers a description defines, for the generators that want to see
+// registers and fields rather than a sequence of things
+// Names are a thing's own name less any leading '_', qnames are as the
+// macros have them.  Origins are the token streams' so the model mustn't
+// outlive the sources it was built from.
+
+class hw_value
+{
+public:
+	wstring name;
+	wstring qname;
+	wstring text;
+	thing::eType type;
+	long number;
+	const wstring * origin;
+	int line;
+
+	virtual ~hw_value()
+	{
+		// Empty
+	}
+
+	hw_value(const thing& name_el, const thing& value_el) :
+		name(name_el.el_name(0, 1)),
+		qname(name_el.el_qname()),
+		text(value_el.el_string()),
+		type(value_el.el_type()),
+		number(value_el.el_type() == thing::number ?
+			value_el.el_tokens().number(value_el.el_token()) : 0),
+		origin(&name_el.el_origin()),
+		line(name_el.el_line_no())
+	{
+		// Empty
+	}
+};
+
+class hw_field
+{
+public:
+	wstring name;
+	wstring qname;
+	const wstring * origin;
+	int line;
+	int shift;
+	int width;
+	int val_shift;
+	bool ro;
+	vector<hw_value> values;
+
+	virtual ~hw_field()
+	{
+		// Empty
+	}
+
+	hw_field(const thing& name_el) :
+		name(name_el.el_name(0, 1)),
+		qname(name_el.el_qname()),
+		origin(&name_el.el_origin()),
+		line(name_el.el_line_no()),
+		shift(0),
+		width(1),
+		val_shift(0),
+		ro(name_el.isro())
+	{
+		// Empty
+	}
+
+	// Where the field is in its register
+	unsigned long mask() const
+	{
+		const unsigned long bits = width >= 32 ? 0xffffffffUL : (1UL << width) - 1;
+		return shift >= 32 ? 0 : (bits << shift) & 0xffffffffUL;
+	}
+
+	const hw_value * find(const wchar_t * const value_name) const
+	{
+		for (size_t i = 0; i != values.size(); ++i)
+			if (values[i].name == value_name)
+				return &values[i];
+		return NULL;
+	}
+};
+
+// A section, or a register if it has fields
+class hw_section
+{
+public:
+	wstring name;
+	wstring qname;
+	const wstring * origin;		// Of where we are named, NULL for the top
+	int line;
+	vector<hw_value> consts;
+	vector<hw_field> fields;
+	vector<hw_section> sections;
+
+	virtual ~hw_section()
+	{
+		// Empty
+	}
+
+	hw_section() :
+		origin(NULL),
+		line(0)
+	{
+		// Empty
+	}
+
+	hw_section(const thing& name_el) :
+		name(name_el.el_name(0, 1)),
+		qname(name_el.el_qname()),
+		origin(&name_el.el_origin()),
+		line(name_el.el_line_no())
+	{
+		// Empty
+	}
+
+	bool is_register() const
+	{
+		return !fields.empty();
+	}
+
+	const hw_value * find(const wchar_t * const const_name) const
+	{
+		for (size_t i = 0; i != consts.size(); ++i)
+			if (consts[i].name == const_name)
+				return &consts[i];
+		return NULL;
+	}
+
+	// Fill in from the things in seq, which belong to parent
+	// Follows the same rules as generate_c so rejects the same descriptions
+	void build(thing_sequence& seq, thing * parent = NULL);
+};
+
+void hw_section::build(thing_sequence& seq, thing * const parent)
+{
+	size_t i = 0;
+
+	// Room for everything first, as growing would copy whole subtrees
+	size_t n_sections = 0;
+	size_t n_fields = 0;
+	size_t n_consts = 0;
+	for (size_t j = 0; j != seq.len(); ++j)
+	{
+		if (seq[j]->el_assigned())
+		{
+			++n_consts;
+			continue;
+		}
+
+		switch (seq[j]->el_type())
+		{
+			case thing::section_start:
+				++n_sections;
+				break;
+			case thing::square_bracket_start:
+				++n_fields;
+				break;
+			default:
+				break;
+		}
+	}
+	sections.reserve(n_sections - (n_sections >= n_fields ? n_fields : 0));
+	fields.reserve(n_fields);
+	consts.reserve(n_consts);
+
+	while (i < seq.len())
+	{
+		thing& name_el = *seq[i++];
+		name_el.set_parent(parent);
+
+		if (!(name_el.el_type() == thing::unquoted_str ||
+			(name_el.el_type() == thing::number && parent != NULL)) || name_el.el_assigned())
+		{
+			throw syntax_error(name_el);
+		}
+
+		thing& el = seq.extract(i++);
+
+		if (el.el_assigned())
+		{
+			consts.push_back(hw_value(name_el, el));
+			continue;
+		}
+
+		switch (el.el_type())
+		{
+			case thing::square_bracket_start:
+			{
+				// Fields belong to a register
+				if (parent == NULL)
+					throw syntax_error(el);
+
+				fields.push_back(hw_field(name_el));
+				hw_field& field = fields.back();
+				static_cast<square_bracket_sequence&>(el.el_sequence()).layout(field.shift,
+					field.width, field.val_shift);
+
+				thing& el2 = seq.extract(i++);
+				if (el2.el_type() != thing::section_start)
+					throw syntax_error(el2);
+
+				hw_section values;
+				values.build(el2.el_sequence(), &name_el);
+				field.values.swap(values.consts);
+				break;
+			}
+
+			case thing::section_start:
+				sections.push_back(hw_section(name_el));
+				sections.back().build(el.el_sequence(), &name_el);
+				break;
+
+			default:
+				throw syntax_error(el);
+		}
+	}
+}
+
+// A name as a C or C++ identifier
+static wstring
+identifier(const wstring& name)
+{
+	if (!name.empty() && iswdigit(name[0]))
+		return L'_' + name;
+	return name;
+}
+
+// A register's slot in its block, its offset in words, or -1 if it has
+// none
+// Registers are 32 bits so need a whole numeric OFFSET a multiple of four
+static long
+register_slot(const hw_section& reg)
+{
+	const hw_value * const offset = reg.find(L"OFFSET");
+
+	if (!reg.is_register() || offset == NULL || offset->type != thing::number ||
+		offset->number < 0 || offset->number % 4 != 0)
+	{
+		return -1;
+	}
+	return offset->number / 4;
+}
+
+// --check's look for registers that can't be right
+// Field overlaps are found by building up a mask of the bits used so far,
+// and shared offsets by sorting each block's registers, so the whole map
+// takes little more than a pass over it
+// Problems are logged as found, errors failing the compile and warnings
+// not.  Registers sharing an offset are only warned about as they may be
+// read and write sides of one address, as --overlay allows.
+class map_checker
+{
+	wostream& log_to;
+
+	void problem(const bool error, const wstring * const origin, const int line,
+		const wstring& text);
+	void check_register(const hw_section& reg);
+	void check_offsets(const hw_section& sec);
+
+public:
+	size_t errors;
+	size_t warnings;
+
+	virtual ~map_checker()
+	{
+		// Empty
+	}
+
+	map_checker(wostream& log) :
+		log_to(log),
+		errors(0),
+		warnings(0)
+	{
+		// Empty
+	}
+
+	void check(const hw_section& sec);
+};
+
+void map_checker::problem(const bool error, const wstring * const origin, const int line,
+	const wstring& text)
+{
+	if (error)
+		++errors;
+	else
+		++warnings;
+	log_to << wstring(hwdc_error(origin != NULL ? *origin : wstring(), line,
+		error ? text : L"warning: " + text)) << L"\n";
+}
+
+void map_checker::check_register(const hw_section& reg)
+{
+	unsigned long used = 0;
+
+	for (size_t i = 0; i != reg.fields.size(); ++i)
+	{
+		const hw_field& field = reg.fields[i];
+
+		if (field.width < 1 || field.shift < 0 || field.shift + field.width > 32)
+		{
+			problem(true, field.origin, field.line, field.qname + L"[" +
+				itowstring(field.shift) + L"," + itowstring(field.width) +
+				L"] is not within 32 bits");
+			continue;
+		}
+
+		const unsigned long mask = field.mask();
+		if ((used & mask) != 0)
+		{
+			size_t j = 0;
+			while ((reg.fields[j].mask() & mask) == 0)
+				++j;
+			problem(true, field.origin, field.line, field.qname + L" overlaps " +
+				reg.fields[j].qname);
+		}
+		used |= mask;
+
+		const unsigned long max = mask >> field.shift;
+		for (size_t j = 0; j != field.values.size(); ++j)
+		{
+			const hw_value& value = field.values[j];
+			if (value.type == thing::number && value.number < 0)
+			{
+				problem(true, value.origin, value.line, value.qname + L" = " + value.text +
+					L" is negative");
+			}
+			else if (value.type == thing::number && (unsigned long)value.number > max)
+			{
+				problem(true, value.origin, value.line, value.qname + L" = " + value.text +
+					L" doesn't fit in " + itowstring(field.width) + L" bits");
+			}
+		}
+	}
+}
+
+void map_checker::check_offsets(const hw_section& sec)
+{
+	vector<pair<long, size_t> > regs;
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+	{
+		const hw_value * const offset = sec.sections[i].find(L"OFFSET");
+		if (offset != NULL && offset->type == thing::number)
+			regs.push_back(make_pair(offset->number, i));
+	}
+	sort(regs.begin(), regs.end());
+
+	for (size_t i = 1; i < regs.size(); ++i)
+	{
+		if (regs[i].first == regs[i - 1].first)
+		{
+			const hw_section& reg = sec.sections[regs[i].second];
+			problem(false, reg.origin, reg.line, reg.qname + L" has the same OFFSET 0x" +
+				itowstring((int)regs[i].first, 16) + L" as " +
+				sec.sections[regs[i - 1].second].qname);
+		}
+	}
+}
+
+void map_checker::check(const hw_section& sec)
+{
+	if (sec.is_register())
+		check_register(sec);
+	check_offsets(sec);
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		check(sec.sections[i]);
+}
+
+// Generate --update's helpers, a <register>_UPDATE for each register in
+// sec with a field that can be written
+static void
+generate_c_update(out_buffer& os, const hw_section& sec)
+{
+	for (size_t i = 0; i != sec.fields.size(); ++i)
+	{
+		if (!sec.fields[i].ro)
+		{
+			os << L"#define " << sec.qname << L"_UPDATE(p, ...) _HWD_UPDATE(" << sec.qname <<
+				L", p, __VA_ARGS__)\n";
+			break;
+		}
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		generate_c_update(os, sec.sections[i]);
+}
+
+// Shadow slot of the register at word offset word, given the block's
+// word offsets sorted and without duplicates
+static long
+shadow_index(const vector<long>& words, const long word)
+{
+	return lower_bound(words.begin(), words.end(), word) - words.begin();
+}
+
+// Generate the shadow of one block, the section holding registers, and
+// of any blocks within it
+// Registers get a slot each in order of offset, those sharing an offset
+// sharing a slot, so sparse blocks don't need a shadow as big as their
+// highest offset
+static void
+generate_c_shadow_block(out_buffer& os, const hw_section& sec)
+{
+	vector<long> words;
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+	{
+		const long word = register_slot(sec.sections[i]);
+		if (word >= 0)
+			words.push_back(word);
+	}
+	sort(words.begin(), words.end());
+	words.erase(unique(words.begin(), words.end()), words.end());
+
+	if (!words.empty() && !sec.name.empty())
+	{
+		const wstring& block = sec.qname;
+
+		os << L"typedef struct\n{\n\tHWD_CACHE_ALIGNED unsigned int regs[" << words.size() <<
+			L"];\n} " << block << L"_SHADOW;\n";
+
+		os << L"#define " << block << L"_SHADOW_INIT(s) (";
+		for (size_t i = 0; i != sec.sections.size(); ++i)
+		{
+			const hw_section& reg = sec.sections[i];
+			const long word = register_slot(reg);
+			if (word >= 0)
+			{
+				os << L"\\\n\t(s)->regs[" << shadow_index(words, word) << L"] = " << reg.qname <<
+					L"_DEFAULT, ";
+			}
+		}
+		os << L"(void)0)\n";
+
+		for (size_t i = 0; i != sec.sections.size(); ++i)
+		{
+			const hw_section& reg = sec.sections[i];
+			const long word = register_slot(reg);
+			bool refetch = false;
+			bool all_ro = true;
+
+			if (word < 0)
+				continue;
+
+			const long slot = shadow_index(words, word);
+
+			for (size_t j = 0; j != reg.fields.size(); ++j)
+			{
+				if (reg.fields[j].ro)
+					refetch = true;
+				else
+					all_ro = false;
+			}
+
+			const wstring& r = reg.qname;
+			const wstring hw = L"_HWD_REG(base, " + itowstring(word * 4) + L")";
+			const wstring shadow = L"(s)->regs[" + itowstring(slot) + L"]";
+
+			os << L"#define " << r << L"_REFETCH " << (refetch ? 1 : 0) << L"\n";
+			if (refetch)
+				os << L"#define " << r << L"_SHADOW_READ(s, base) (" << shadow << L" = " << hw << L")\n";
+			else
+				os << L"#define " << r << L"_SHADOW_READ(s, base) (" << shadow << L")\n";
+
+			if (all_ro)
+				continue;
+
+			os << L"#define " << r << L"_SHADOW_WRITE(s, base, v) (" << hw << L" = " <<
+				shadow << L" = (v))\n";
+			os << L"#define " << r << L"_SHADOW_UPDATE(s, base, ...) (\\\n\t_HWD_UPDATE(" << r <<
+				L", &" << shadow << L", __VA_ARGS__), " << hw << L" = " << shadow << L")\n";
+		}
+		os << L"\n";
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		generate_c_shadow_block(os, sec.sections[i]);
+}
+
+// Generate --shadow's copies of the registers
+// Each block gets a cache line aligned struct with a slot per register,
+// and each register accessors that read the shadow and write through to
+// the hardware at base.  Registers with read only fields can change
+// underneath us so are always read from the hardware.
+static void
+generate_c_shadow(out_buffer& os, const hw_section& root)
+{
+	os << "#ifndef HWD_C_SHADOW\n"
+		"#define HWD_C_SHADOW\n"
+		"\n"
+		"#ifndef HWD_CACHE_ALIGNED\n"
+		"#ifdef _MSC_VER\n"
+		"#define HWD_CACHE_ALIGNED __declspec(align(64))\n"
+		"#else\n"
+		"#define HWD_CACHE_ALIGNED __attribute__((aligned(64)))\n"
+		"#endif\n"
+		"#endif\n"
+		"\n"
+		"#define _HWD_REG(base, offset) (*(volatile unsigned int *)((char *)(base) + (offset)))\n"
+		"\n"
+		"#endif\n"
+		"\n";
+
+	generate_c_shadow_block(os, root);
+}
+
+// Generate the overlay of one block, the section holding registers, and
+// of any blocks within it
+static void
+generate_c_overlay_block(out_buffer& os, const hw_section& sec)
+{
+	vector<pair<long, size_t> > regs;
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+	{
+		const long slot = register_slot(sec.sections[i]);
+		if (slot >= 0)
+			regs.push_back(make_pair(slot, i));
+	}
+	sort(regs.begin(), regs.end());
+
+	if (!regs.empty() && !sec.name.empty())
+	{
+		const wstring& block = sec.qname;
+		long next = 0;
+
+		os << L"typedef struct\n{\n";
+		for (size_t i = 0; i != regs.size(); ++i)
+		{
+			const long slot = regs[i].first;
+			const hw_section& reg = sec.sections[regs[i].second];
+
+			// Only the first of registers sharing an offset gets it
+			if (slot < next)
+			{
+				os << L"\t/* " << identifier(reg.name) << L" shares 0x" <<
+					itowstring(slot * 4, 16) << L" */\n";
+				continue;
+			}
+			if (slot > next)
+			{
+				os << L"\tunsigned int _pad" << itowstring(next * 4, 16) << L"[" <<
+					slot - next << L"];\n";
+			}
+			os << L"\tvolatile unsigned int " << identifier(reg.name) << L"; /* 0x" <<
+				itowstring(slot * 4, 16) << L" */\n";
+			next = slot + 1;
+		}
+		os << L"} " << block << L"_REGS;\n";
+
+		for (size_t i = 0; i != regs.size(); ++i)
+		{
+			if (i != 0 && regs[i].first == regs[i - 1].first)
+				continue;
+
+			os << L"HWD_STATIC_ASSERT(offsetof(" << block << L"_REGS, " <<
+				identifier(sec.sections[regs[i].second].name) << L") == " << regs[i].first * 4 <<
+				L", \"" << block << L"_REGS layout\");\n";
+		}
+		os << L"HWD_STATIC_ASSERT(sizeof(" << block << L"_REGS) == " << next * 4 <<
+			L", \"" << block << L"_REGS size\");\n";
+		os << L"#define " << block << L"_REGS_AT(base) ((" << block << L"_REGS *)(base))\n\n";
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		generate_c_overlay_block(os, sec.sections[i]);
+}
+
+// Generate --overlay's structs, one per block with each register a member
+// at its OFFSET, so a block mapped once at base is accessed as
+// <block>_REGS_AT(base)->REG
+// Every member is a 32 bit word at a word offset so the struct has no
+// padding but what we put there, and the asserts check the compiler agrees
+static void
+generate_c_overlay(out_buffer& os, const hw_section& root)
+{
+	os << "#ifndef HWD_C_OVERLAY\n"
+		"#define HWD_C_OVERLAY\n"
+		"\n"
+		"#include <stddef.h>\n"
+		"\n"
+		"#ifdef __cplusplus\n"
+		"#define HWD_STATIC_ASSERT(c, m) static_assert(c, m)\n"
+		"#else\n"
+		"#define HWD_STATIC_ASSERT(c, m) _Static_assert(c, m)\n"
+		"#endif\n"
+		"\n"
+		"#endif\n"
+		"\n";
+
+	generate_c_overlay_block(os, root);
+}
+
+// Generate the dispatch table of one block, the section holding
+// registers, and of any blocks within it
+static void
+generate_c_dispatch_block(out_buffer& os, const hw_section& sec)
+{
+	vector<pair<long, size_t> > regs;
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+	{
+		const hw_section& reg = sec.sections[i];
+		const hw_value * const offset = reg.find(L"OFFSET");
+
+		if (reg.is_register() && offset != NULL && offset->type == thing::number &&
+			offset->number >= 0)
+		{
+			regs.push_back(make_pair(offset->number, i));
+		}
+	}
+	sort(regs.begin(), regs.end());
+
+	// Only the first of registers sharing an offset is found
+	size_t n = 0;
+	for (size_t i = 0; i != regs.size(); ++i)
+		if (n == 0 || regs[i].first != regs[n - 1].first)
+			regs[n++] = regs[i];
+	regs.resize(n);
+
+	if (!regs.empty() && !sec.name.empty())
+	{
+		const wstring& block = sec.qname;
+
+		os << L"static const hwd_field_desc " << block << L"_FIELDS[] =\n{\n";
+		for (size_t i = 0; i != regs.size(); ++i)
+		{
+			const hw_section& reg = sec.sections[regs[i].second];
+			for (size_t j = 0; j != reg.fields.size(); ++j)
+			{
+				const hw_field& f = reg.fields[j];
+				os << L"\t{ \"" << f.name << L"\", " << f.shift << L", " << f.width << L", 0x" <<
+					itowstring(f.mask(), 16) << L", " << (f.ro ? 1 : 0) << L" },\n";
+			}
+		}
+		os << L"};\n";
+
+		os << L"static const hwd_reg_desc " << block << L"_DESCS[] =\n{\n";
+		size_t first_field = 0;
+		bool word_aligned = true;
+		for (size_t i = 0; i != regs.size(); ++i)
+		{
+			const hw_section& reg = sec.sections[regs[i].second];
+			unsigned long ro_mask = 0;
+
+			for (size_t j = 0; j != reg.fields.size(); ++j)
+				if (reg.fields[j].ro)
+					ro_mask |= reg.fields[j].mask();
+
+			os << L"\t{ 0x" << itowstring(regs[i].first, 16) << L", \"" << reg.qname << L"\", " <<
+				reg.qname << L"_DEFAULT, 0x" << itowstring(ro_mask, 16) << L", &" << block <<
+				L"_FIELDS[" << first_field << L"], " << reg.fields.size() << L" },\n";
+			first_field += reg.fields.size();
+			if (regs[i].first % 4 != 0)
+				word_aligned = false;
+		}
+		os << L"};\n";
+
+		// A dense index by word offset where at least half its slots are
+		// used, otherwise a binary search
+		// Entries are one more than the register's, 0 meaning none, so
+		// need more than a short when every one of 65536 slots is used
+		const long slots = regs.back().first / 4 + 1;
+		os << L"static inline const hwd_reg_desc *\n" << block << L"_LOOKUP(const unsigned int offset)\n{\n";
+		if (word_aligned && slots <= (long)regs.size() * 2 && slots <= 65536)
+		{
+			vector<size_t> index(slots, 0);
+			for (size_t i = 0; i != regs.size(); ++i)
+				index[regs[i].first / 4] = i + 1;
+
+			os << L"\tstatic const unsigned " << (regs.size() < 65536 ? L"short" : L"int") <<
+				L" index[" << slots << L"] =\n\t{";
+			for (long i = 0; i != slots; ++i)
+				os << (i % 16 == 0 ? L"\n\t\t" : L" ") << index[i] << L",";
+			os << L"\n\t};\n"
+				L"\n\tif ((offset & 3) != 0 || offset >= " << slots * 4 <<
+				L" || index[offset >> 2] == 0)\n\t\treturn 0;\n"
+				L"\treturn &" << block << L"_DESCS[index[offset >> 2] - 1];\n";
+		}
+		else
+		{
+			os << L"\treturn hwd_find_desc(" << block << L"_DESCS, " << regs.size() << L", offset);\n";
+		}
+		os << L"}\n\n";
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		generate_c_dispatch_block(os, sec.sections[i]);
+}
+
+// Generate --dispatch's tables for finding a register from its offset,
+// as a trap handler emulating the hardware has to
+// Each block gets its registers' descriptions sorted by offset and
+// <block>_LOOKUP(offset) to find one in constant or logarithmic time
+static void
+generate_c_dispatch(out_buffer& os, const hw_section& root)
+{
+	os << "#ifndef HWD_C_DISPATCH\n"
+		"#define HWD_C_DISPATCH\n"
+		"\n"
+		"typedef struct\n"
+		"{\n"
+		"\tconst char *name;\n"
+		"\tunsigned int shift;\n"
+		"\tunsigned int width;\n"
+		"\tunsigned int mask;\n"
+		"\tunsigned int ro;\n"
+		"} hwd_field_desc;\n"
+		"\n"
+		"typedef struct\n"
+		"{\n"
+		"\tunsigned int offset;\n"
+		"\tconst char *name;\n"
+		"\tunsigned int reset;\n"
+		"\tunsigned int ro_mask;\n"
+		"\tconst hwd_field_desc *fields;\n"
+		"\tunsigned int n_fields;\n"
+		"} hwd_reg_desc;\n"
+		"\n"
+		"/* The description at offset among n sorted by offset, or 0 */\n"
+		"static inline const hwd_reg_desc *\n"
+		"hwd_find_desc(const hwd_reg_desc *descs, unsigned int n, const unsigned int offset)\n"
+		"{\n"
+		"\twhile (n > 1)\n"
+		"\t{\n"
+		"\t\tconst unsigned int half = n / 2;\n"
+		"\t\tdescs = descs[half].offset <= offset ? descs + half : descs;\n"
+		"\t\tn -= half;\n"
+		"\t}\n"
+		"\treturn n == 1 && descs->offset == offset ? descs : 0;\n"
+		"}\n"
+		"\n"
+		"#endif\n"
+		"\n";
+
+	generate_c_dispatch_block(os, root);
+}
+
+// Orders bucket numbers biggest bucket first
+class bigger_bucket
+{
+	const vector<vector<size_t> >& buckets;
+
+public:
+	virtual ~bigger_bucket()
+	{
+		// Empty
+	}
+
+	bigger_bucket(const vector<vector<size_t> >& b) :
+		buckets(b)
+	{
+		// Empty
+	}
+
+	bool operator ()(const size_t a, const size_t b) const
+	{
+		return buckets[a].size() > buckets[b].size();
+	}
+};
+
+// A minimal perfect hash, by hash and displace
+// Keys are spread over buckets by one hash, then each bucket, biggest
+// first, is given the first seed that hashes all its keys to free slots.
+// Searching for seeds that hit the last few free slots would be slow, so
+// buckets of one key just take the next free slot, given as the seed with
+// direct_slot set.
+class perfect_hash
+{
+public:
+	enum
+	{
+		direct_slot = 0x80000000U
+	};
+
+	vector<unsigned int> seeds;
+	vector<size_t> slots;
+
+	virtual ~perfect_hash()
+	{
+		// Empty
+	}
+
+	perfect_hash(const vector<string>& keys);
+
+	// Keys are hashed once then mixed with each seed tried
+	// Also generated as hwd_name_hash() and hwd_name_mix() so must not change
+	// 64 bits so that distinct keys all but never hash the same, which
+	// no seed could then separate
+	static unsigned long long hash(const string& key)
+	{
+		unsigned long long h = 14695981039346656037ULL;
+		for (size_t i = 0; i != key.length(); ++i)
+			h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+		return h;
+	}
+
+	static unsigned int mix(unsigned long long h, const unsigned int seed)
+	{
+		h ^= seed * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return (unsigned int)h;
+	}
+};
+
+perfect_hash::perfect_hash(const vector<string>& keys) :
+	seeds(keys.size() / 4 + 1, 0),
+	slots(keys.size(), 0)
+{
+	const size_t n = keys.size();
+	const size_t m = seeds.size();
+	vector<vector<size_t> > buckets(m);
+	vector<size_t> order(m);
+	vector<char> used(n, false);
+	vector<unsigned long long> hashes(n);
+	vector<size_t> tried;
+
+	for (size_t i = 0; i != n; ++i)
+	{
+		hashes[i] = hash(keys[i]);
+		buckets[mix(hashes[i], 0) % m].push_back(i);
+	}
+	for (size_t b = 0; b != m; ++b)
+		order[b] = b;
+	stable_sort(order.begin(), order.end(), bigger_bucket(buckets));
+
+	size_t i = 0;
+	for (; i != m && buckets[order[i]].size() > 1; ++i)
+	{
+		const vector<size_t>& bucket = buckets[order[i]];
+
+		for (unsigned int seed = 1; ; ++seed)
+		{
+			if (seed == direct_slot)
+				throw hwdc_error(0, L"Names hash the same: " + wstring(keys[bucket[0]].begin(),
+					keys[bucket[0]].end()));
+
+			tried.clear();
+			for (size_t j = 0; j != bucket.size(); ++j)
+			{
+				const size_t slot = mix(hashes[bucket[j]], seed) % n;
+				if (used[slot] || find(tried.begin(), tried.end(), slot) != tried.end())
+					break;
+				tried.push_back(slot);
+			}
+
+			if (tried.size() == bucket.size())
+			{
+				for (size_t j = 0; j != bucket.size(); ++j)
+				{
+					used[tried[j]] = true;
+					slots[tried[j]] = bucket[j];
+				}
+				seeds[order[i]] = seed;
+				break;
+			}
+		}
+	}
+
+	size_t free_slot = 0;
+	for (; i != m && buckets[order[i]].size() == 1; ++i)
+	{
+		while (used[free_slot])
+			++free_slot;
+		used[free_slot] = true;
+		slots[free_slot] = buckets[order[i]][0];
+		seeds[order[i]] = direct_slot | (unsigned int)free_slot;
+	}
+}
+
+// A name --names can look up
+class name_entry
+{
+public:
+	string name;
+	unsigned long offset;
+	int shift;
+	unsigned long mask;
+
+	virtual ~name_entry()
+	{
+		// Empty
+	}
+
+	name_entry(const wstring& qname, const unsigned long reg_offset, const int field_shift,
+		const unsigned long field_mask) :
+		name(qname.begin(), qname.end()),
+		offset(reg_offset),
+		shift(field_shift),
+		mask(field_mask)
+	{
+		// Empty
+	}
+};
+
+// Every register and field in sec and the sections within it
+static void
+collect_names(const hw_section& sec, vector<name_entry>& names)
+{
+	if (sec.is_register())
+	{
+		const hw_value * const offset = sec.find(L"OFFSET");
+		const unsigned long reg_offset = offset != NULL && offset->type == thing::number ?
+			(unsigned long)offset->number : 0xffffffffUL;
+
+		names.push_back(name_entry(sec.qname, reg_offset, 0, 0xffffffffUL));
+		for (size_t i = 0; i != sec.fields.size(); ++i)
+		{
+			const hw_field& f = sec.fields[i];
+			names.push_back(name_entry(f.qname, reg_offset, f.shift, f.mask()));
+		}
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		collect_names(sec.sections[i], names);
+}
+
+// A C identifier from the name of file, less its directory and extension
+static string
+file_identifier(const filename_t file)
+{
+	const filename_str path(file);
+	size_t start = 0;
+	size_t end = path.length();
+
+	for (size_t i = 0; i != path.length(); ++i)
+	{
+		if (path[i] == '/' || path[i] == '\\')
+		{
+			start = i + 1;
+			end = path.length();
+		}
+		else if (path[i] == '.')
+		{
+			end = i;
+		}
+	}
+
+	string ident;
+	for (size_t i = start; i < end; ++i)
+	{
+		const unsigned int c = (unsigned int)path[i];
+		ident += c < 128 && isalnum(c) ? (char)c : '_';
+	}
+	if (ident.empty() || isdigit((unsigned char)ident[0]))
+		ident = "hwd_" + ident;
+	return ident;
+}
+
+// Generate --names' lookup of registers and fields by qualified name
+// The names are placed by a minimal perfect hash so finding one is a hash
+// and a compare.  prefix names the tables, so headers from different
+// files can be used together.
+static void
+generate_c_names(out_buffer& os, const hw_section& root, const string& prefix)
+{
+	vector<name_entry> all;
+	vector<name_entry> names;
+	vector<string> keys;
+	unordered_map<string, size_t> seen;
+
+	collect_names(root, all);
+	for (size_t i = 0; i != all.size(); ++i)
+	{
+		// The first of any duplicates wins
+		if (seen.insert(make_pair(all[i].name, i)).second)
+		{
+			names.push_back(all[i]);
+			keys.push_back(all[i].name);
+		}
+	}
+
+	os << "#ifndef HWD_C_NAMES\n"
+		"#define HWD_C_NAMES\n"
+		"\n"
+		"#include <string.h>\n"
+		"\n"
+		"#define HWD_NO_OFFSET 0xffffffffU\n"
+		"\n"
+		"typedef struct\n"
+		"{\n"
+		"\tconst char *name;\n"
+		"\tunsigned int offset;\t\t/* Of the register, HWD_NO_OFFSET if unknown */\n"
+		"\tunsigned int shift;\n"
+		"\tunsigned int mask;\t\t/* In place, all ones for a register */\n"
+		"} hwd_name_desc;\n"
+		"\n"
+		"static inline unsigned long long\n"
+		"hwd_name_hash(const char *name)\n"
+		"{\n"
+		"\tunsigned long long h = 14695981039346656037ULL;\n"
+		"\twhile (*name != '\\0')\n"
+		"\t\th = (h ^ (unsigned char)*name++) * 1099511628211ULL;\n"
+		"\treturn h;\n"
+		"}\n"
+		"\n"
+		"static inline unsigned int\n"
+		"hwd_name_mix(unsigned long long h, const unsigned int seed)\n"
+		"{\n"
+		"\th ^= seed * 0x9e3779b97f4a7c15ULL;\n"
+		"\th ^= h >> 33;\n"
+		"\th *= 0xff51afd7ed558ccdULL;\n"
+		"\th ^= h >> 33;\n"
+		"\th *= 0xc4ceb9fe1a85ec53ULL;\n"
+		"\th ^= h >> 33;\n"
+		"\treturn (unsigned int)h;\n"
+		"}\n"
+		"\n"
+		"#endif\n"
+		"\n";
+
+	if (names.empty())
+		return;
+
+	const perfect_hash ph(keys);
+
+	os << "static const unsigned int " << prefix << "_NAME_SEEDS[" << ph.seeds.size() << "] =\n{";
+	for (size_t i = 0; i != ph.seeds.size(); ++i)
+		os << (i % 8 == 0 ? "\n\t" : " ") << "0x" << itowstring((int)ph.seeds[i], 16) << ",";
+	os << "\n};\n";
+
+	os << "static const hwd_name_desc " << prefix << "_NAMES[" << names.size() << "] =\n{\n";
+	for (size_t i = 0; i != ph.slots.size(); ++i)
+	{
+		const name_entry& e = names[ph.slots[i]];
+		os << "\t{ \"" << e.name << "\", 0x" << itowstring((int)e.offset, 16) << ", " <<
+			e.shift << ", 0x" << itowstring((int)e.mask, 16) << " },\n";
+	}
+	os << "};\n";
+
+	os << "static inline const hwd_name_desc *\n" << prefix << "_lookup_name(const char *name)\n"
+		"{\n"
+		"\tconst unsigned long long h = hwd_name_hash(name);\n"
+		"\tconst unsigned int seed = " << prefix << "_NAME_SEEDS[hwd_name_mix(h, 0) % " <<
+		ph.seeds.size() << "];\n"
+		"\tconst hwd_name_desc *d = &" << prefix << "_NAMES[seed & 0x80000000U ?\n"
+		"\t\tseed & 0x7fffffffU : hwd_name_mix(h, seed) % " << names.size() << "];\n"
+		"\treturn strcmp(d->name, name) == 0 ? d : 0;\n"
+		"}\n\n";
+}
+
+// The --db register database, see hwddb.h for the layout
+class register_db
+{
+	vector<hwddb_block> blocks;
+	vector<hwddb_register> registers;
+	vector<hwddb_field> fields;
+	vector<hwddb_value> values;
+	string strings;
+	unordered_map<wstring, uint32_t> string_offsets;
+
+	uint32_t add_string(const wstring& str);
+	void add_block(const hw_section& sec);
+
+	template <class T>
+	static void add_table(string& out, const vector<T>& table)
+	{
+		if (!table.empty())
+			out.append((const char *)&table[0], table.size() * sizeof(T));
+	}
+
+public:
+	virtual ~register_db()
+	{
+		// Empty
+	}
+
+	register_db(const hw_section& root)
+	{
+		add_string(wstring());
+		add_block(root);
+	}
+
+	// The whole file
+	string bytes() const;
+};
+
+// Where str is in the string table, adding it if it is new
+uint32_t register_db::add_string(const wstring& str)
+{
+	const unordered_map<wstring, uint32_t>::const_iterator found = string_offsets.find(str);
+	if (found != string_offsets.end())
+		return found->second;
+
+	const uint32_t offset = (uint32_t)strings.length();
+	for (size_t i = 0; i != str.length(); ++i)
+		strings += (char)str[i];
+	strings += '\0';
+	string_offsets[str] = offset;
+	return offset;
+}
+
+// Add sec as a block if it has registers, then any blocks within it
+void register_db::add_block(const hw_section& sec)
+{
+	size_t n_registers = 0;
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		if (sec.sections[i].is_register())
+			++n_registers;
+
+	if (n_registers != 0)
+	{
+		hwddb_block block;
+		block.name = add_string(sec.name);
+		block.qname = add_string(sec.qname);
+		block.first_register = (uint32_t)registers.size();
+		block.n_registers = (uint32_t)n_registers;
+		blocks.push_back(block);
+
+		for (size_t i = 0; i != sec.sections.size(); ++i)
+		{
+			const hw_section& reg_sec = sec.sections[i];
+			if (!reg_sec.is_register())
+				continue;
+
+			const hw_value * const offset = reg_sec.find(L"OFFSET");
+			hwddb_register reg;
+			reg.name = add_string(reg_sec.name);
+			reg.qname = add_string(reg_sec.qname);
+			reg.block = (uint32_t)(blocks.size() - 1);
+			reg.flags = HWDDB_REG_RESET;
+			reg.offset = HWDDB_NONE;
+			reg.reset = 0;
+			reg.first_field = (uint32_t)fields.size();
+			reg.n_fields = (uint32_t)reg_sec.fields.size();
+			if (offset != NULL && offset->type == thing::number)
+			{
+				reg.flags |= HWDDB_REG_OFFSET;
+				reg.offset = (uint32_t)offset->number;
+			}
+
+			for (size_t j = 0; j != reg_sec.fields.size(); ++j)
+			{
+				const hw_field& f = reg_sec.fields[j];
+				hwddb_field field;
+				field.name = add_string(f.name);
+				field.qname = add_string(f.qname);
+				field.reg = (uint32_t)registers.size();
+				field.flags = f.ro ? HWDDB_FIELD_RO : 0;
+				field.shift = (uint32_t)f.shift;
+				field.width = (uint32_t)f.width;
+				field.mask = (uint32_t)f.mask();
+				field.val_shift = (uint32_t)f.val_shift;
+				field.first_value = (uint32_t)values.size();
+				field.n_values = (uint32_t)f.values.size();
+				fields.push_back(field);
+
+				if (f.ro)
+					reg.flags |= HWDDB_REG_REFETCH;
+
+				// The reset value is known if every default is a number
+				// A field shifted out of the register adds nothing to it,
+				// and shifting by 32 or more isn't defined
+				const hw_value * const def = f.find(L"DEFAULT");
+				if (def != NULL && def->type != thing::number)
+					reg.flags &= ~HWDDB_REG_RESET;
+				else if (def != NULL && f.shift >= 0 && f.shift < 32)
+					reg.reset |= ((uint32_t)def->number << f.shift) & field.mask;
+
+				for (size_t k = 0; k != f.values.size(); ++k)
+				{
+					const hw_value& v = f.values[k];
+					hwddb_value value;
+					value.name = add_string(v.name);
+					value.qname = add_string(v.qname);
+					value.field = (uint32_t)(fields.size() - 1);
+					value.flags = v.type == thing::number ? HWDDB_VALUE_NUMBER : 0;
+					value.number = (int32_t)v.number;
+					value.text = add_string(v.text);
+					values.push_back(value);
+				}
+			}
+			if ((reg.flags & HWDDB_REG_RESET) == 0)
+				reg.reset = 0;
+			registers.push_back(reg);
+		}
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		add_block(sec.sections[i]);
+}
+
+string register_db::bytes() const
+{
+	hwddb_header header;
+	header.magic = HWDDB_MAGIC;
+	header.version = HWDDB_VERSION;
+	header.header_size = sizeof(hwddb_header);
+	header.n_blocks = (uint32_t)blocks.size();
+	header.blocks = header.header_size;
+	header.n_registers = (uint32_t)registers.size();
+	header.registers = header.blocks + header.n_blocks * sizeof(hwddb_block);
+	header.n_fields = (uint32_t)fields.size();
+	header.fields = header.registers + header.n_registers * sizeof(hwddb_register);
+	header.n_values = (uint32_t)values.size();
+	header.values = header.fields + header.n_fields * sizeof(hwddb_field);
+	header.strings_size = (uint32_t)strings.length();
+	header.strings = header.values + header.n_values * sizeof(hwddb_value);
+	header.file_size = header.strings + header.strings_size;
+
+	string out((const char *)&header, sizeof(header));
+	out.reserve(header.file_size);
+	add_table(out, blocks);
+	add_table(out, registers);
+	add_table(out, fields);
+	add_table(out, values);
+
+	// Everything so far is 32 bit words, which are little endian in the file
+	const uint32_t one = 1;
+	if (*(const char *)&one != 1)
+	{
+		for (size_t i = 0; i < out.length(); i += 4)
+		{
+			swap(out[i], out[i + 3]);
+			swap(out[i + 1], out[i + 2]);
+		}
+	}
+
+	out += strings;
+	return out;
+}
+
+// Support for the C++ backend, emitted once at the top of each header
+static const char cpp_support[] =
+	"#ifndef HWD_CPP_SUPPORT\n"
+	"#define HWD_CPP_SUPPORT\n"
+	"\n"
+	"#include <cstdint>\n"
+	"#include <type_traits>\n"
+	"\n"
+	"static_assert(__cplusplus >= 201703L, \"hwdc2 C++ headers need C++17\");\n"
+	"\n"
+	"namespace hwd\n"
+	"{\n"
+	"\ttypedef std::uint32_t reg_t;\n"
+	"\n"
+	"\t// A value for field F, already shifted into place\n"
+	"\ttemplate <class F>\n"
+	"\tstruct value\n"
+	"\t{\n"
+	"\t\treg_t bits;\n"
+	"\t};\n"
+	"\n"
+	"\t// Field F of register R, Width bits from bit Shift\n"
+	"\ttemplate <class F, class R, unsigned Shift, unsigned Width, unsigned ValShift, bool ReadOnly>\n"
+	"\tstruct field\n"
+	"\t{\n"
+	"\t\ttypedef R reg;\n"
+	"\t\tstatic constexpr unsigned shift = Shift;\n"
+	"\t\tstatic constexpr unsigned width = Width;\n"
+	"\t\tstatic constexpr bool read_only = ReadOnly;\n"
+	"\t\tstatic constexpr reg_t bits = Width >= 32 ? ~reg_t(0) : (reg_t(1) << Width) - 1;\n"
+	"\t\tstatic constexpr reg_t mask = bits << Shift;\n"
+	"\n"
+	"\t\t// As _OF, x as it is\n"
+	"\t\tstatic constexpr value<F> of(const reg_t x)\n"
+	"\t\t{\n"
+	"\t\t\treturn value<F>{(x << Shift) & mask};\n"
+	"\t\t}\n"
+	"\n"
+	"\t\t// As _VAL, the field's bits of x\n"
+	"\t\tstatic constexpr value<F> val(const reg_t x)\n"
+	"\t\t{\n"
+	"\t\t\treturn of((x >> ValShift) & bits);\n"
+	"\t\t}\n"
+	"\n"
+	"\t\t// The field from register value r\n"
+	"\t\tstatic constexpr reg_t get(const reg_t r)\n"
+	"\t\t{\n"
+	"\t\t\treturn (r & mask) >> Shift;\n"
+	"\t\t}\n"
+	"\t};\n"
+	"\n"
+	"\t// Register R, whose fields are members of it\n"
+	"\ttemplate <class R>\n"
+	"\tstruct reg\n"
+	"\t{\n"
+	"\t\t// old with the given fields replaced\n"
+	"\t\t// Fields of other registers and read only fields don't compile\n"
+	"\t\ttemplate <class... F>\n"
+	"\t\tstatic constexpr reg_t update(const reg_t old, const value<F>... v)\n"
+	"\t\t{\n"
+	"\t\t\tstatic_assert((true && ... && std::is_same<typename F::reg, R>::value),\n"
+	"\t\t\t\t\"field of another register\");\n"
+	"\t\t\tstatic_assert(!(false || ... || F::read_only), \"read only field\");\n"
+	"\t\t\treturn (old & ~(reg_t(0) | ... | F::mask)) | (reg_t(0) | ... | v.bits);\n"
+	"\t\t}\n"
+	"\n"
+	"\t\t// Set the given fields of the register at r with one read and one write\n"
+	"\t\ttemplate <class... F>\n"
+	"\t\tstatic void modify(volatile reg_t& r, const value<F>... v)\n"
+	"\t\t{\n"
+	"\t\t\tr = update(r, v...);\n"
+	"\t\t}\n"
+	"\n"
+	"\t\t// As _RMKS, but fields not given keep their defaults\n"
+	"\t\ttemplate <class... F>\n"
+	"\t\tstatic constexpr reg_t make(const value<F>... v)\n"
+	"\t\t{\n"
+	"\t\t\treturn update(R::DEFAULT, v...);\n"
+	"\t\t}\n"
+	"\t};\n"
+	"}\n"
+	"\n"
+	"#endif\n"
+	"\n";
+
+// A value as a C++ string literal
+static wstring
+cpp_string(const wstring& text)
+{
+	wstring lit(1, L'"');
+	for (size_t i = 0; i != text.length(); ++i)
+	{
+		if (text[i] == L'"' || text[i] == L'\\')
+			lit += L'\\';
+		lit += text[i];
+	}
+	lit += L'"';
+	return lit;
+}
+
+// Generate one section as a C++ namespace or, for registers and anything
+// inside one, a struct
+// Constants that are neither numbers nor strings become strings of their
+// text, and field values that aren't numbers are left out, so no value's
+// text is ever taken as C++.  A register's own DEFAULT is the one made
+// from its fields', as with the macros.
+static void
+generate_cpp_section(out_buffer& os, const hw_section& sec, const wstring& indent, bool in_struct)
+{
+	const bool is_struct = in_struct || sec.is_register();
+	const wstring inner = indent + L'\t';
+	const wstring name = identifier(sec.name);
+
+	if (!sec.name.empty())
+	{
+		if (!is_struct)
+			os << indent << L"namespace " << name << L"\n";
+		else if (sec.is_register())
+			os << indent << L"struct " << name << L" : hwd::reg<" << name << L">\n";
+		else
+			os << indent << L"struct " << name << L"\n";
+		os << indent << L"{\n";
+	}
+	const wstring& in = sec.name.empty() ? indent : inner;
+
+	for (size_t i = 0; i != sec.consts.size(); ++i)
+	{
+		const hw_value& c = sec.consts[i];
+
+		if (sec.is_register() && c.name == L"DEFAULT")
+			continue;
+
+		os << in << (is_struct ? L"static" : L"inline") << L" constexpr auto " <<
+			identifier(c.name) << L" = ";
+		if (c.type == thing::number)
+			os << c.text;
+		else
+			os << cpp_string(c.text);
+		os << L";\n";
+	}
+
+	for (size_t i = 0; i != sec.fields.size(); ++i)
+	{
+		const hw_field& f = sec.fields[i];
+		const wstring fname = identifier(f.name);
+		bool seen_default = false;
+
+		os << in << L"struct " << fname << L" : hwd::field<" << fname << L", " << name <<
+			L", " << f.shift << L", " << f.width << L", " << f.val_shift << L", " <<
+			(f.ro ? L"true" : L"false") << L">\n";
+		os << in << L"{\n";
+		for (size_t j = 0; j != f.values.size(); ++j)
+		{
+			const hw_value& v = f.values[j];
+
+			if (v.type != thing::number)
+				continue;
+
+			os << in << L"\tstatic constexpr hwd::value<" << fname << L"> " <<
+				identifier(v.name) << L" = of(" << v.text << L");\n";
+			if (v.name == L"DEFAULT")
+				seen_default = true;
+		}
+		if (!seen_default)
+			os << in << L"\tstatic constexpr hwd::value<" << fname << L"> DEFAULT = of(0);\n";
+		os << in << L"};\n";
+	}
+
+	if (sec.is_register())
+	{
+		os << in << L"static constexpr hwd::reg_t DEFAULT =";
+		for (size_t i = 0; i != sec.fields.size(); ++i)
+		{
+			os << (i == 0 ? L"\n" : L" |\n") << in << L'\t' <<
+				identifier(sec.fields[i].name) << L"::DEFAULT.bits";
+		}
+		os << L";\n";
+	}
+
+	for (size_t i = 0; i != sec.sections.size(); ++i)
+		generate_cpp_section(os, sec.sections[i], in, is_struct);
+
+	if (!sec.name.empty())
+		os << indent << (is_struct ? L"};\n" : L"}\n");
+}
+
+// Generate the C++ backend's header, constexpr descriptions of each field
+// in place of the macros
+static void
+generate_cpp(out_buffer& os, const hw_section& root)
+{
+	os << cpp_support;
+	generate_cpp_section(os, root, wstring(), false);
+}
+
+// How we were asked to compile
+class hwdc_options
 {
 public:
-	virtual ~section_sequence()
+	enum eBackend
+	{
+		c,
+		cpp
+	};
+
+	eBackend backend;
+	bool update;
+	bool shadow;
+	bool overlay;
+	bool dispatch;
+	bool names;
+	bool split;
+	bool check;
+	bool watch;
+	bool if_changed;
+	bool stream;
+	bool parse_only;
+	filename_str db_file;
+	filename_str deps_file;
+	filename_str cache_dir;
+	filename_str stats_file;
+	unsigned int threads;
+
+	virtual ~hwdc_options()
 	{
 		// Empty
 	}
-	section_sequence(pp_stream& in) :
-		thing_sequence(in, thing::section_end)
+
+	hwdc_options() :
+		backend(c),
+		update(false),
+		shadow(false),
+		overlay(false),
+		dispatch(false),
+		names(false),
+		split(false),
+		check(false),
+		watch(false),
+		if_changed(false),
+		stream(false),
+		parse_only(false),
+		threads(1)
 	{
 		// Empty
 	}
 };
 
+static double
+seconds_now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-thing_sequence::thing_sequence(pp_stream& in, const thing::eType expected_end)
+// Peak memory use of the whole process in KB
+static long
+peak_rss_kb()
 {
-	for (;;)
+#if IS_UNIX
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+#else
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return (long)(pmc.PeakWorkingSetSize / 1024);
+#endif
+}
+
+static void
+json_string(string& json, const filename_str& str)
+{
+	json += '"';
+	for (size_t i = 0; i != str.length(); ++i)
+	{
+		const unsigned int c = (unsigned int)str[i];
+		if (c == '"' || c == '\\')
+		{
+			json += '\\';
+			json += (char)c;
+		}
+		else if (c < 0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			json += buf;
+		}
+		else
+		{
+			json += (char)c;
+		}
+	}
+	json += '"';
+}
+
+// What happened in one compile, for --stats
+class compile_stats
+{
+public:
+	enum ePhase
+	{
+		open,
+		cache,
+		lex,
+		parse,
+		generate,
+		stream,
+		write,
+		n_phases
+	};
+
+	filename_str input;
+	bool ok;
+	bool cache_hit;
+	bool written;
+	double phases[n_phases];
+	double total;
+	size_t tokens[thing::op + 1];
+	size_t things;
+	size_t sequences;
+	size_t symbols;
+	size_t macros;
+	size_t output_bytes;
+
+private:
+	double started;
+	double last;
+
+public:
+	virtual ~compile_stats()
+	{
+		// Empty
+	}
+
+	compile_stats(const filename_str& in) :
+		input(in),
+		ok(false),
+		cache_hit(false),
+		written(false),
+		total(0),
+		things(0),
+		sequences(0),
+		symbols(0),
+		macros(0),
+		output_bytes(0),
+		started(seconds_now()),
+		last(started)
+	{
+		for (int i = 0; i != n_phases; ++i)
+			phases[i] = 0;
+		for (int i = 0; i <= thing::op; ++i)
+			tokens[i] = 0;
+	}
+
+	// Charge the time since the last phase ended to this one
+	void end_phase(const ePhase phase)
+	{
+		const double now = seconds_now();
+		phases[phase] += now - last;
+		last = now;
+		total = now - started;
+	}
+
+	// Add in the tokens and parse tree of one more source
+	void count(const token_stream& toks)
+	{
+		for (int i = 0; i <= thing::op; ++i)
+			tokens[i] += toks.count((thing::eType)i);
+		things += toks.things();
+		sequences += toks.sequences();
+		symbols += toks.symbols().size();
+	}
+
+	// As a single line of JSON
+	string json() const;
+};
+
+string compile_stats::json() const
+{
+	static const char * const phase_names[n_phases] =
 	{
-		Ptr<thing> t = new thing(in);
-		thing::eType t_type = t->el_type();
+		"open", "cache", "lex", "parse", "generate", "stream", "write"
+	};
+	static const char * const type_names[thing::op + 1] =
+	{
+		"empty", "eof", "unquoted_str", "quoted_str", "number", "section_start",
+		"section_end", "square_bracket_start", "square_bracket_end", "assign",
+		"comma", "op"
+	};
+
+	char buf[64];
+	string json("{\"input\":");
+	json_string(json, input);
+	json += ok ? ",\"ok\":true" : ",\"ok\":false";
+	json += cache_hit ? ",\"cache_hit\":true" : ",\"cache_hit\":false";
+
+	json += ",\"seconds\":{";
+	for (int i = 0; i != n_phases; ++i)
+	{
+		snprintf(buf, sizeof(buf), "\"%s\":%.6f,", phase_names[i], phases[i]);
+		json += buf;
+	}
+	snprintf(buf, sizeof(buf), "\"total\":%.6f}", total);
+	json += buf;
+
+	json += ",\"tokens\":{";
+	for (int i = 0; i <= thing::op; ++i)
+	{
+		snprintf(buf, sizeof(buf), "%s\"%s\":%lu", i == 0 ? "" : ",", type_names[i],
+			(unsigned long)tokens[i]);
+		json += buf;
+	}
+	json += '}';
+
+	snprintf(buf, sizeof(buf), ",\"things\":%lu", (unsigned long)things);
+	json += buf;
+	snprintf(buf, sizeof(buf), ",\"sequences\":%lu", (unsigned long)sequences);
+	json += buf;
+	snprintf(buf, sizeof(buf), ",\"symbols\":%lu", (unsigned long)symbols);
+	json += buf;
+	snprintf(buf, sizeof(buf), ",\"macros\":%lu", (unsigned long)macros);
+	json += buf;
+	snprintf(buf, sizeof(buf), ",\"output_bytes\":%lu", (unsigned long)output_bytes);
+	json += buf;
+	json += written ? ",\"written\":true" : ",\"written\":false";
+	snprintf(buf, sizeof(buf), ",\"peak_rss_kb\":%ld}\n", peak_rss_kb());
+	json += buf;
+	return json;
+}
+
+// Write a generated file, leaving it alone if unchanged and asked to
+// Returns whether it was written
+static bool
+put_file(const filename_t filename, const string& data, const hwdc_options& opts)
+{
+	if (opts.if_changed)
+		return update_file(filename, data);
+	write_file(filename, data);
+	return true;
+}
+
+// Generate --split's headers, one per top level block in a file named
+// after outfile and the block, with outs given the umbrella header that
+// includes them all along with anything else at the top level
+// root is the register model of things, if the options need one, and blocks
+// any cache of the blocks' macros
+static void
+generate_split(thing_sequence& things, const hw_section& root, const filename_t infile,
+	const filename_t outfile, const hwdc_options& opts, out_buffer& outs,
+	block_cache * const blocks)
+{
+	vector<size_t> starts;
+	if (!things.split_blocks(starts))
+	{
+		// Whatever is wrong will be found
+		out_buffer scratch;
+		things.generate_c(scratch);
+		throw hwdc_error(0, L"Can't split into blocks");
+	}
 
-		switch (t_type)
+	// PList on its own would name thing_sequence's private base
+	std::PList<block_job> jobs;
+	if (opts.backend == hwdc_options::c)
+	{
+		things.generate_jobs(jobs, starts, opts.threads, blocks);
+		for (size_t i = 0; i != jobs.len(); ++i)
 		{
-			case thing::square_bracket_start:
+			if (!jobs[i]->error.isnull())
 			{
-				t->set_sequence(new square_bracket_sequence(in));
-				*this << t;
-				break;
+				const hwdc_error err(*jobs[i]->error);
+				jobs.deleteall();
+				throw err;
 			}
-			case thing::section_start:
+		}
+	}
+
+	// Block headers are named <outfile less extension>_<block>.h and
+	// included by their name alone
+	const filename_str out_path(outfile);
+	size_t base_start = 0;
+	size_t base_end = out_path.length();
+	for (size_t i = 0; i != out_path.length(); ++i)
+	{
+		if (out_path[i] == '/' || out_path[i] == '\\')
+			base_start = i + 1;
+		else if (out_path[i] == '.' && i >= base_start)
+			base_end = i;
+	}
+	if (base_end < base_start)
+		base_end = out_path.length();
+
+	const string guard = file_identifier(outfile) + "_H";
+	outs << "#ifndef " << guard << "\n#define " << guard << "\n\n";
+
+	hw_section top;
+	top.consts = root.consts;
+	if (opts.backend == hwdc_options::cpp)
+		generate_cpp(outs, top);
+
+	size_t section_no = 0;
+	for (size_t i = 0; i + 1 < starts.size(); ++i)
+	{
+		const thing& next = *things[starts[i] + 1];
+		if (next.el_assigned() || next.el_type() != thing::section_start)
+		{
+			if (opts.backend == hwdc_options::c)
+				outs << jobs[i]->text();
+			continue;
+		}
+
+		const hw_section * const block = section_no < root.sections.size() ?
+			&root.sections[section_no] : NULL;
+		++section_no;
+
+		const wstring& name = things[starts[i]]->el_string();
+		const filename_str block_file = out_path.substr(0, base_end) + filename_char('_') +
+			filename_str(name.begin(), name.end()) + filename_char('.') + filename_char('h');
+		const filename_str block_base = block_file.substr(base_start);
+		const string block_guard = file_identifier(block_file.c_str()) + "_H";
+
+		out_buffer os;
+		os << "#ifndef " << block_guard << "\n#define " << block_guard << "\n\n";
+		if (opts.backend == hwdc_options::cpp)
+		{
+			generate_cpp(os, *block);
+		}
+		else
+		{
+			if (opts.update || opts.shadow)
+				generate_c_support(os);
+			os << jobs[i]->text();
+			if (opts.update)
+				generate_c_update(os, *block);
+			if (opts.overlay)
+				generate_c_overlay(os, *block);
+			if (opts.shadow)
+				generate_c_shadow(os, *block);
+			if (opts.dispatch)
+				generate_c_dispatch(os, *block);
+			if (opts.names)
+				generate_c_names(os, *block, file_identifier(infile) + "_" + string(name.begin(), name.end()));
+		}
+		os << "#endif\n";
+		put_file(block_file.c_str(), os.str(), opts);
+
+		outs << "#include \"" << string(block_base.begin(), block_base.end()) << "\"\n";
+	}
+	jobs.deleteall();
+
+	outs << "\n#endif\n";
+}
+
+// Where the cache keeps name
+static filename_str
+cache_path(const hwdc_options& opts, const string& name)
+{
+	return opts.cache_dir + filename_char('/') + filename_str(name.begin(), name.end());
+}
+
+// Add the names and contents of imported files to a cache key, mapping
+// them if may_map
+// Returns false if one of them can't be read
+static bool
+add_imports(content_hash& key, const vector<filename_str>& imports, const bool may_map)
+{
+	for (size_t i = 0; i != imports.size(); ++i)
+	{
+		mapped_file in(imports[i].c_str(), may_map);
+		if (!in.is_open())
+			return false;
+
+		const unsigned long long size = (unsigned long long)(in.end() - in.begin());
+		key.add(imports[i].data(), imports[i].length() * sizeof(filename_char)).add("", 1).
+			add(&size, sizeof(size)).add(in.begin(), (size_t)size);
+	}
+	return true;
+}
+
+// A file name as make wants it in a rule
+static string
+make_path(const filename_str& name)
+{
+	string path;
+	for (size_t i = 0; i != name.length(); ++i)
+	{
+		if (name[i] == ' ' || name[i] == '#')
+			path += '\\';
+		else if (name[i] == '$')
+			path += '$';
+		path += (char)name[i];
+	}
+	return path;
+}
+
+// A make rule saying outfile is made from infile and its imports
+// Each import gets an empty rule of its own too, so make carries on if one
+// is deleted along with its import
+static string
+make_deps(const filename_t infile, const filename_t outfile, const vector<filename_str>& imports)
+{
+	string deps = make_path(outfile) + ": " + make_path(infile);
+	for (size_t i = 0; i != imports.size(); ++i)
+		deps += " \\\n " + make_path(imports[i]);
+	deps += "\n";
+	for (size_t i = 0; i != imports.size(); ++i)
+		deps += "\n" + make_path(imports[i]) + ":\n";
+	return deps;
+}
+
+// Compile the first of sources into a header, written to stdout if outfile
+// is NULL
+// Progress and errors are written to log, and what happened to stats.
+// Top level blocks are looked for in blocks, if given, before generating
+// them.
+// Returns false if the compile failed
+static bool
+compile(source_set& sources, const filename_t outfile, const hwdc_options& opts,
+	wostream& log, compile_stats& stats, block_cache * const blocks)
+{
+	try
+	{
+		const filename_t infile = sources[0].name.c_str();
+		const pp_stream& src = sources[0].src;
+		token_stream& tokens = sources[0].tokens;
+		out_buffer outs;
+		if (!src.is_open())
+			throw hwdc_error(0, L"Cannot open input file");
+		stats.end_phase(compile_stats::open);
+
+		if (opts.parse_only)
+		{
+			tokens.lex_all();
+			stats.end_phase(compile_stats::lex);
+			sources.parse(opts.threads);
+			stats.end_phase(compile_stats::parse);
+			for (size_t i = 0; i != sources.len(); ++i)
+				stats.count(sources[i].tokens);
+			stats.ok = true;
+			return true;
+		}
+
+		if (!opts.stats_file.empty())
+			outs.count_macros();
+
+		// Output we may want to compare or keep, or that --check may yet
+		// reject, is gathered in memory and written at the end, otherwise it
+		// goes as we make it
+		const bool whole = outfile != NULL &&
+			(opts.if_changed || !opts.cache_dir.empty() || opts.check);
+		if (!whole)
+			outs.open(outfile);
+
+		// Output is cached under the hash of the input and generator
+		// Which files the input imports is only known once it is parsed, so
+		// that is cached too, under the input's own key, and the output
+		// under a key that adds in the imported files
+		string key;
+		filename_str cache_file;
+		filename_str db_cache_file;
+		vector<filename_str> imports;
+		string cached;
+		string db;
+		if (!opts.cache_dir.empty())
+		{
+			// Only output that passed --check is cached with it
+			const char flavour[7] =
 			{
-				t->set_sequence(new section_sequence(in));
-				*this << t;
-				break;
+				(char)opts.backend, (char)opts.update, (char)opts.shadow, (char)opts.overlay,
+				(char)opts.dispatch, (char)opts.names, (char)opts.check
+			};
+			content_hash input_key;
+			input_key.add(hwdc2_version, sizeof(hwdc2_version)).add(flavour, sizeof(flavour));
+
+			// The --names lookups are named after the input file
+			if (opts.names)
+				input_key.add(file_identifier(infile)).add("", 1);
+			key = input_key.add(src.text(), src.length()).hex();
+
+			string full_key = key;
+			string listed;
+			bool found = true;
+			if (read_file(cache_path(opts, key + ".imports").c_str(), listed))
+			{
+				for (size_t start = 0, end; start < listed.length(); start = end + 1)
+				{
+					end = listed.find('\n', start);
+					if (end == string::npos)
+						end = listed.length();
+					imports.push_back(filename_str(listed.begin() + start, listed.begin() + end));
+				}
+				content_hash import_key;
+				import_key.add(key);
+				found = add_imports(import_key, imports, !opts.watch);
+				full_key = import_key.hex();
 			}
 
-			case thing::eof:
-			case thing::section_end:
-			case thing::square_bracket_end:
-				if (t_type != expected_end)
+			cache_file = cache_path(opts, full_key + ".h");
+			db_cache_file = cache_path(opts, full_key + ".db");
+			stats.cache_hit = found && read_file(cache_file.c_str(), cached) &&
+				(opts.db_file.empty() || read_file(db_cache_file.c_str(), db));
+			stats.end_phase(compile_stats::cache);
+		}
+
+		// Each top level block's macros are kept too, under the input's name,
+		// so a block that hasn't changed since then isn't generated again
+		block_cache * macro_cache = blocks;
+		block_cache kept_blocks;
+		filename_str blocks_file;
+		if (!stats.cache_hit && blocks == NULL && !cache_file.empty() && whole &&
+			opts.backend == hwdc_options::c && !opts.stream)
+		{
+			const filename_str canon = canonical_path(infile);
+			blocks_file = cache_path(opts, content_hash().add(hwdc2_version, sizeof(hwdc2_version)).
+				add(canon.data(), canon.length() * sizeof(filename_char)).hex() + ".blocks");
+			kept_blocks.load(blocks_file.c_str());
+			macro_cache = &kept_blocks;
+			stats.end_phase(compile_stats::cache);
+		}
+
+		if (stats.cache_hit)
+		{
+			outs << cached;
+		}
+		else
+		{
+			if (opts.backend == hwdc_options::c && !opts.split && (opts.update || opts.shadow))
+				generate_c_support(outs);
+			if (opts.stream)
+			{
+				generate_stream(sources, 0, outs);
+				stats.end_phase(compile_stats::stream);
+			}
+			else
+			{
+				tokens.lex_all();
+				stats.end_phase(compile_stats::lex);
+				sources.parse(opts.threads);
+				thing_sequence things;
+				sources.splice(things);
+				stats.end_phase(compile_stats::parse);
+				// The generators that see registers rather than things, and
+				// the check, which comes before any output
+				hw_section root;
+				const bool modelled = opts.backend != hwdc_options::c || opts.update ||
+					opts.shadow || opts.overlay || opts.dispatch || opts.names || opts.check ||
+					!opts.db_file.empty();
+				if (modelled)
+					root.build(things);
+				if (opts.check)
 				{
-					wcout << L"**** bad brackets ***\n";
-					throw syntax_error(*t);
+					map_checker checker(log);
+					checker.check(root);
+					// A summary of the whole file, so with no line number
+					if (checker.errors != 0)
+					{
+						log << checker.errors << (checker.errors == 1 ? L" error" : L" errors") <<
+							L" found by --check\n";
+						return false;
+					}
 				}
-				return;
 
-			default:
-				*this << t;
-				break;
+				if (opts.split)
+				{
+					generate_split(things, root, infile, outfile, opts, outs, macro_cache);
+				}
+				else
+				{
+					if (opts.backend == hwdc_options::c)
+						things.generate_blocks(outs, opts.threads, macro_cache);
+					if (opts.backend == hwdc_options::cpp)
+						generate_cpp(outs, root);
+					if (opts.update)
+						generate_c_update(outs, root);
+					if (opts.overlay)
+						generate_c_overlay(outs, root);
+					if (opts.shadow)
+						generate_c_shadow(outs, root);
+					if (opts.dispatch)
+						generate_c_dispatch(outs, root);
+					if (opts.names)
+						generate_c_names(outs, root, file_identifier(infile));
+				}
+				if (!opts.db_file.empty())
+					db = register_db(root).bytes();
+				stats.end_phase(compile_stats::generate);
+			}
+
+			sources.imported(imports);
+			for (size_t i = 0; i != sources.len(); ++i)
+				stats.count(sources[i].tokens);
+
+			if (!cache_file.empty() && whole)
+			{
+				if (!imports.empty())
+				{
+					string listed;
+					for (size_t i = 0; i != imports.size(); ++i)
+						listed += string(imports[i].begin(), imports[i].end()) + "\n";
+					replace_file(cache_path(opts, key + ".imports"), listed);
+
+					content_hash import_key;
+					import_key.add(key);
+					if (!add_imports(import_key, imports, !opts.watch))
+						throw hwdc_error(0, L"Cannot reread imports");
+					cache_file = cache_path(opts, import_key.hex() + ".h");
+					db_cache_file = cache_path(opts, import_key.hex() + ".db");
+				}
+				replace_file(cache_file, outs.str());
+				if (!opts.db_file.empty())
+					replace_file(db_cache_file, db);
+				if (!blocks_file.empty())
+				{
+					kept_blocks.sweep();
+					kept_blocks.save(blocks_file);
+				}
+			}
+		}
+
+		stats.output_bytes = outs.total();
+		stats.macros = outs.macros();
+		if (!whole)
+		{
+			outs.close();
+			stats.written = true;
+		}
+		else if (opts.if_changed)
+		{
+			stats.written = update_file(outfile, outs.str());
+		}
+		else
+		{
+			write_file(outfile, outs.str());
+			stats.written = true;
+		}
+
+		if (opts.db_file.empty())
+		{
+			// Nothing more
+		}
+		else if (opts.if_changed)
+		{
+			update_file(opts.db_file.c_str(), db);
+		}
+		else
+		{
+			write_file(opts.db_file.c_str(), db);
 		}
+
+		if (!opts.deps_file.empty())
+			put_file(opts.deps_file.c_str(), make_deps(infile, outfile, imports), opts);
+		stats.end_phase(compile_stats::write);
+	}
+	catch (hwdc_error& err)
+	{
+		log << wstring(err) << L"\n";
+		return false;
+	}
+
+	stats.ok = true;
+	return true;
+}
+
+// Compile one .hwd file into a header, written to stdout if outfile is NULL
+// As above, but reading everything afresh
+static bool
+compile(const filename_t infile, const filename_t outfile, const hwdc_options& opts,
+	wostream& log, compile_stats& stats)
+{
+	try
+	{
+		source_set sources(infile, log);
+		return compile(sources, outfile, opts, log, stats, NULL);
+	}
+	catch (hwdc_error& err)
+	{
+		log << wstring(err) << L"\n";
+		return false;
+	}
+}
+
+// Write the --stats report, one line of JSON per compile, to stderr if
+// filename is "-"
+static void
+write_stats(const filename_str& filename, const string& report)
+{
+	if (filename == filename_str(1, '-'))
+	{
+		wcerr.flush();
+		fwrite(report.data(), 1, report.length(), stderr);
+		fflush(stderr);
+		return;
+	}
+
+	try
+	{
+		write_file(filename.c_str(), report);
+	}
+	catch (hwdc_error& err)
+	{
+		wcerr << wstring(err) << L"\n";
+	}
+}
+
+class batch_job
+{
+public:
+	filename_str infile;
+	filename_str outfile;
+	wstring log;
+	string stats;
+	bool ok;
+
+	batch_job(const filename_str& in, const filename_str& out) :
+		infile(in),
+		outfile(out),
+		ok(false)
+	{
+		// Empty
 	}
-}
-
+};
 
-void generate_rmk_hdr(wostream& os, const thing &parent, const PtrList<thing> &bthings, const wchar_t * rmk)
+// Worker for run_batch
+// Takes the next job not yet started until none are left
+// Anything thrown past compile fails just its job, rather than escaping
+// the thread
+static void
+batch_worker(vector<batch_job> * const jobs, atomic<size_t> * const next_job,
+	const hwdc_options * const opts)
 {
-	os << L"#define " << parent.el_name() << rmk;
-	bool arg1 = true;
-	const size_t blen = bthings.len();
-	for (size_t i = 0; i != blen; ++i)
+	size_t i;
+
+	while ((i = (*next_job)++) < jobs->size())
 	{
-		if (!bthings[i]->isro())
+		batch_job& job = (*jobs)[i];
+		wostringstream log;
+		compile_stats stats(job.infile);
+		try
 		{
-			if (!arg1)
-				os << L',';
-			arg1 = false;
-			os << bthings[i]->el_argname();
+			job.ok = compile(job.infile.c_str(), job.outfile.c_str(), *opts, log, stats);
+		}
+		catch (std::exception& err)
+		{
+			log << wstring(hwdc_error(err)) << L"\n";
+			job.ok = false;
+		}
+		catch (...)
+		{
+			log << wstring(hwdc_error(0, L"Unknown error")) << L"\n";
+			job.ok = false;
 		}
+		job.log = log.str();
+		if (!opts->stats_file.empty())
+			job.stats = stats.json();
 	}
-	os << L") (\\\n\t((";
 }
 
-void thing_sequence::generate_c(wostream& os, thing * parent, const int argno)
+// Compile all the jobs using up to n_threads threads
+// Logs are printed in job order once everything is done
+// Returns false if any job failed
+static bool
+run_batch(vector<batch_job>& jobs, unsigned int n_threads, const hwdc_options& opts)
 {
-	size_t i = 0;
-	int sb_count = 0;
-	bool seen_default = false;
-	bool all_ro = true;
-	PtrList<thing> bthings;
-
-	while (i < len())
-	{
-		thing& name = *(*this)[i++];
-		name.set_parent(parent);
+	atomic<size_t> next_job(0);
 
-		// Start with unquoted-string
-		// Numbers are valid unless prefix is empty
-		if (!(name.el_type() == thing::unquoted_str ||
-			(name.el_type() == thing::number && parent != NULL)))
-		{
-			throw syntax_error(name);
-		}
+	if (n_threads == 0)
+		n_threads = 1;
+	if (n_threads > jobs.size())
+		n_threads = (unsigned int)jobs.size();
 
-		// Various things valid next
-		thing& el = extract(i++);
+	vector<thread> threads;
+	for (unsigned int i = 1; i < n_threads; ++i)
+		threads.push_back(thread(batch_worker, &jobs, &next_job, &opts));
+	batch_worker(&jobs, &next_job, &opts);
+	for (size_t i = 0; i != threads.size(); ++i)
+		threads[i].join();
 
-		switch (el.el_type())
-		{
-			case thing::assign:
-			{
-				thing& el2 = extract(i++);
+	bool ok = true;
+	string report;
+	for (size_t i = 0; i != jobs.size(); ++i)
+	{
+		wcout << jobs[i].log;
+		report += jobs[i].stats;
+		if (!jobs[i].ok)
+			ok = false;
+	}
 
-				// All sorts of things possible
-				os << L"#define " << name.el_name() << L" " << el2.el_string() << L"\n";
-				if (argno > 0)
-				{
-					os << L"#define _" << name.el_name(2) << L"_arg" << argno <<
-						L"_" << name.el_name(0, 2) <<
-						L" " << el2.el_string() << L"\n";
-				}
+	if (!opts.stats_file.empty())
+		write_stats(opts.stats_file, report);
+	return ok;
+}
 
-				if (name.el_string() == L"DEFAULT")
-					seen_default = true;
+// Read a batch manifest: whitespace separated <infile> <outfile> pairs,
+// with '#' starting a comment that runs to the end of the line
+static bool
+read_manifest(const filename_t filename, vector<batch_job>& jobs)
+{
+	mapped_file manifest(filename);
+	if (!manifest.is_open())
+	{
+		wcerr << L"Cannot open manifest '" << filename << L"'\n";
+		return false;
+	}
 
-				break;
-			}
+	vector<filename_str> names;
+	const char * p = manifest.begin();
+	const char * const end = manifest.end();
 
-			case thing::square_bracket_start:
-			{
-				++sb_count;
+	while (p != end)
+	{
+		if (*p == '#')
+		{
+			while (p != end && *p != '\n')
+				++p;
+		}
+		else if (isspace((unsigned char)*p))
+		{
+			++p;
+		}
+		else
+		{
+			const char * const start = p;
+			while (p != end && !isspace((unsigned char)*p))
+				++p;
+			names.push_back(filename_str(start, p));
+		}
+	}
 
-				name.fix_reserved(sb_count);
+	if (names.size() % 2 != 0)
+	{
+		wcerr << L"Manifest '" << filename << L"' has an input with no output\n";
+		return false;
+	}
 
-				el.el_sequence().generate_c(os, &name, sb_count);
+	for (size_t i = 0; i != names.size(); i += 2)
+		jobs.push_back(batch_job(names[i], names[i + 1]));
+	return true;
+}
 
-				// We expect section start next
-				thing& el2 = extract(i++);
-				if (el2.el_type() != thing::section_start)
-					throw syntax_error(el2);
+// Waits for files to change
+// With inotify it is the directories holding the files that are watched,
+// as editors often save by writing a new file and renaming it over the
+// old.  Elsewhere each file's modification time and size are looked at
+// every so often.
+class file_watcher
+{
+	vector<filename_str> files;
+#if HAS_INOTIFY
+	int fd;
 
-				el2.el_sequence().generate_c(os, &name, sb_count);
-				os << L"\n";
+	// Each watched directory's files, by their name in it
+	unordered_map<int, vector<pair<filename_str, size_t> > > dirs;
+#else
+	vector<pair<long long, long long> > stamps;
 
-				bthings << &name;
-				if (!name.isro())
-					all_ro = false;
+	static pair<long long, long long> stamp(const filename_str& name)
+	{
+#if IS_UNIX
+		struct stat st;
+		if (stat(name.c_str(), &st) != 0)
+#else
+		struct _stat st;
+		if (_wstat(name.c_str(), &st) != 0)
+#endif
+			return make_pair(-1LL, -1LL);
+		return make_pair((long long)st.st_mtime, (long long)st.st_size);
+	}
+#endif
 
-				break;
-			}
+	file_watcher(const file_watcher&);
+	file_watcher& operator= (const file_watcher&);
 
-			case thing::section_start:
-			{
-				el.el_sequence().generate_c(os, &name);
-				break;
-			}
+public:
+	virtual ~file_watcher()
+	{
+#if HAS_INOTIFY
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
 
-			default:
-				throw syntax_error(el);
-		}
+	file_watcher()
+	{
+#if HAS_INOTIFY
+		if ((fd = inotify_init()) < 0)
+			throw hwdc_error(0, L"Cannot watch files");
+#endif
 	}
 
-	if (argno > 0)
+	void watch(const vector<filename_str>& names);
+	void wait(vector<size_t>& changed);
+};
+
+// Watch names, and only those, numbering them by their place in names
+void file_watcher::watch(const vector<filename_str>& names)
+{
+	files = names;
+#if HAS_INOTIFY
+	dirs.clear();
+	for (size_t i = 0; i != files.size(); ++i)
 	{
-		if (!seen_default)
-		{
-			os << "#define " << parent->el_name() << L"_DEFAULT 0\n";
-		}
+		const size_t slash = files[i].rfind('/');
+		const filename_str dir = slash == filename_str::npos ? filename_str(".") :
+			slash == 0 ? filename_str("/") : files[i].substr(0, slash);
+		const int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0)
+			throw hwdc_error(0, L"Cannot watch '" + wstring(dir.begin(), dir.end()) + L"'");
+		dirs[wd].push_back(make_pair(files[i].substr(slash + 1), i));
 	}
+#else
+	stamps.resize(files.size());
+	for (size_t i = 0; i != files.size(); ++i)
+		stamps[i] = stamp(files[i]);
+#endif
+}
 
-	if (bthings.len() != 0)
+// Wait for some of the files to change, giving which in changed
+// Changes that come together, as saving several files at once, are waited
+// for together
+void file_watcher::wait(vector<size_t>& changed)
+{
+	changed.clear();
+#if HAS_INOTIFY
+	alignas(inotify_event) char buf[4096];
+	int timeout = -1;
+
+	for (;;)
 	{
-		const size_t blen = bthings.len();
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
 
-		if (!all_ro)
+		const int n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			throw hwdc_error(0, L"Cannot watch files");
+		if (n == 0)
+			return;
+
+		const ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			throw hwdc_error(0, L"Cannot watch files");
+
+		for (const char * p = buf; p < buf + len; )
 		{
-			generate_rmk_hdr(os, *parent, bthings, L"_RMK(");
-			for (size_t i = 0; i != blen; ++i)
-			{
-				if (i != 0)
-					os << L" | \\\n\t((";
-				if (bthings[i]->isro())
-					os << bthings[i]->el_name() << L"_DEFAULT";
-				else
-					os << bthings[i]->el_argname();
-	
-				os << L") << _" << bthings[i]->el_name() << L"_SHIFT)";
-			}
-			os << L")\n";
-	
-			generate_rmk_hdr(os, *parent, bthings, L"_RMKS(");
-			for (size_t i = 0; i != blen; ++i)
+			const inotify_event * const ev = (const inotify_event *)p;
+			p += sizeof(inotify_event) + ev->len;
+
+			const unordered_map<int, vector<pair<filename_str, size_t> > >::const_iterator dir =
+				dirs.find(ev->wd);
+			if (ev->len == 0 || dir == dirs.end())
+				continue;
+
+			for (size_t i = 0; i != dir->second.size(); ++i)
 			{
-				if (i != 0)
-					os << L" | \\\n\t((";
-	
-				if (bthings[i]->isro())
-					os << bthings[i]->el_name() << L"_DEFAULT";
-				else
-					os << L'_' << parent->el_name() << L"_arg" << (i + 1) << L"_##" <<
-						 bthings[i]->el_argname();
-				os << L") << _" << bthings[i]->el_name() << L"_SHIFT)";
+				if (dir->second[i].first == ev->name &&
+					find(changed.begin(), changed.end(), dir->second[i].second) == changed.end())
+				{
+					changed.push_back(dir->second[i].second);
+					timeout = 50;
+				}
 			}
-			os << L")\n";
 		}
-
-		os << L"#define " << parent->el_name() << L"_DEFAULT (\\\n\t(";
-		for (size_t i = 0; i != blen; ++i)
+	}
+#else
+	while (changed.empty())
+	{
+		this_thread::sleep_for(chrono::milliseconds(100));
+		for (size_t i = 0; i != files.size(); ++i)
 		{
-			if (i != 0)
-				os << L" | \\\n\t(";
-
-			os << bthings[i]->el_name() << L"_DEFAULT << _" << bthings[i]->el_name() << "_SHIFT)";
+			const pair<long long, long long> now = stamp(files[i]);
+			if (now != stamps[i])
+			{
+				stamps[i] = now;
+				changed.push_back(i);
+			}
 		}
-		os << L")\n\n";
-
-
 	}
+#endif
 }
 
-void square_bracket_sequence::generate_c(wostream& os, thing * const parent, const int argno)
+// Compile, then compile again whenever the input or anything it imports
+// changes, until killed
+// Only the files that changed are read and parsed again, and only the top
+// level blocks that changed have their macros generated again
+// Sources are read rather than mapped, as an editor saving one could
+// otherwise pull the text from under what was kept of it
+static int
+watch(const filename_t infile, const filename_t outfile, const hwdc_options& opts)
 {
-	size_t i = 0;
-	size_t j = 0;
-	int vals[3];
-
-	vals[0] = 0;
-	vals[1] = 1;
-	vals[2] = 0;
-
-	while (i < len())
+	try
 	{
-		thing& el = *(*this)[i++];
+		source_set sources(infile, wcout, false);
+		block_cache blocks;
+		file_watcher watcher;
 
-		switch (el.el_type())
+		for (;;)
 		{
-			case thing::comma:
-				if (++j >= 3)
-					throw syntax_error(el);
-				break;
-			case thing::number:
-				vals[j] = el.el_number();
-				break;
-			default:
-				throw syntax_error(el);
-		}
-	}
+			compile_stats stats(infile);
+			if (compile(sources, outfile, opts, wcout, stats, &blocks))
+				blocks.sweep();
+			if (!opts.stats_file.empty())
+				write_stats(opts.stats_file, stats.json());
+			wcout << L"Watching for changes\n";
+			wcout.flush();
 
-	field_shift = vals[0];
-	mask = vals[1] == 32 ? 0xffffffff : (1U << vals[1]) - 1;
-	val_shift = vals[2];
+			vector<filename_str> names;
+			for (size_t i = 0; i != sources.len(); ++i)
+				names.push_back(sources[i].name);
+			watcher.watch(names);
 
-	os << L"#define _" << parent->el_name() << L"_SHIFT " << field_shift << L"\n";
-	os << L"#define _" << parent->el_name() << L"_MASK 0x" << itowstring(mask << field_shift, 16) << L"\n";
-
-	if (!parent->isro())
+			vector<size_t> changed;
+			watcher.wait(changed);
+			for (size_t i = 0; i != changed.size(); ++i)
+				sources.reload(changed[i]);
+		}
+	}
+	catch (hwdc_error& err)
 	{
-		os << "#define " << parent->el_name() << L"_OF(x) (x)\n";
-		os << L"#define _" << parent->el_name(1) << L"_arg" << argno <<
-			L"_" << parent->el_name(0, 1) << L"_OF(x) (x)\n";
-	
-		os << "#define " << parent->el_name() << L"_VAL(x) " << sb_val() << L"\n";
-		os << L"#define _" << parent->el_name(1) << L"_arg" << argno <<
-			L"_" << parent->el_name(0, 1) << L"_VAL(x) " << sb_val() << L"\n";;
+		wcout << wstring(err) << L"\n";
 	}
-
-
+	return 1;
 }
 
-
-
-void thing::set_sequence(thing_sequence * const seq)
+static void
+usage()
 {
-	section = seq;
+	wcerr << L"Usage: hwdc2 [<options>] <infile> [<outfile>]\n"
+		L"       hwdc2 [<options>] --batch <infile> <outfile> [<infile> <outfile> ...]\n"
+		L"       hwdc2 [<options>] --manifest <file>\n"
+		L"Options:\n"
+		L"  -j <threads>      Threads to use (default: one per CPU)\n"
+		L"  --backend <name>  c for macros (the default), cpp for C++17 constexpr fields\n"
+		L"  --update          Add a macro per register setting any of its fields at once (c backend only)\n"
+		L"  --shadow          Add cached copies of each block's registers (c backend only)\n"
+		L"  --overlay         Add a struct per block with its registers at their offsets (c backend only)\n"
+		L"  --dispatch        Add a table per block for finding registers by offset (c backend only)\n"
+		L"  --names           Add a perfect hash lookup of registers and fields by name (c backend only)\n"
+		L"  --split           Write a header per top level block, with outfile including them all\n"
+		L"  --check           Fail on overlapping or oversized fields and values, warn of shared offsets\n"
+		L"  --db <file>       Also write the registers to file as a database, see hwddb.h\n"
+		L"  --deps <file>     Also write a make rule naming the files imported\n"
+		L"  --if-changed      Leave output files alone if their contents would not change\n"
+		L"  --cache <dir>     Reuse output previously generated from identical input, and each\n"
+		L"                    unchanged top level block's macros otherwise\n"
+		L"  --stream          Output each top level block as soon as it is parsed (c backend only)\n"
+		L"  --watch           Compile again each time the input or anything it imports changes\n"
+		L"  --parse-only      Stop after parsing, with no output\n"
+		L"  --stats <file>    Write timings and counts as JSON lines to file (- for stderr)\n";
 }
 
+#if IS_UNIX
+#define ARG_STR(s) s
+#define arg_to_ul strtoul
+#else
+#define ARG_STR(s) L##s
+#define arg_to_ul wcstoul
+#endif
+
 #if IS_UNIX
 int
 main(int argc, char *argv[])
@@ -698,29 +5221,163 @@ int
 wmain(int argc, wchar_t *argv[])
 #endif
 {
-	if (argc < 2)
+	unsigned int n_threads = thread::hardware_concurrency();
+	hwdc_options opts;
+	vector<batch_job> jobs;
+	bool batch = false;
+	int argi = 1;
+
+	for (; argi < argc && argv[argi][0] == '-'; ++argi)
+	{
+		const filename_str arg(argv[argi]);
+
+		if (arg == ARG_STR("-j") && argi + 1 < argc)
+		{
+			n_threads = (unsigned int)arg_to_ul(argv[++argi], NULL, 10);
+		}
+		else if (arg == ARG_STR("--backend") && argi + 1 < argc)
+		{
+			const filename_str name(argv[++argi]);
+			if (name == ARG_STR("c"))
+				opts.backend = hwdc_options::c;
+			else if (name == ARG_STR("cpp"))
+				opts.backend = hwdc_options::cpp;
+			else
+			{
+				usage();
+				return 1;
+			}
+		}
+		else if (arg == ARG_STR("--update"))
+		{
+			opts.update = true;
+		}
+		else if (arg == ARG_STR("--shadow"))
+		{
+			opts.shadow = true;
+		}
+		else if (arg == ARG_STR("--overlay"))
+		{
+			opts.overlay = true;
+		}
+		else if (arg == ARG_STR("--dispatch"))
+		{
+			opts.dispatch = true;
+		}
+		else if (arg == ARG_STR("--names"))
+		{
+			opts.names = true;
+		}
+		else if (arg == ARG_STR("--split"))
+		{
+			opts.split = true;
+		}
+		else if (arg == ARG_STR("--check"))
+		{
+			opts.check = true;
+		}
+		else if (arg == ARG_STR("--db") && argi + 1 < argc)
+		{
+			opts.db_file = argv[++argi];
+		}
+		else if (arg == ARG_STR("--deps") && argi + 1 < argc)
+		{
+			opts.deps_file = argv[++argi];
+		}
+		else if (arg == ARG_STR("--if-changed"))
+		{
+			opts.if_changed = true;
+		}
+		else if (arg == ARG_STR("--parse-only"))
+		{
+			opts.parse_only = true;
+		}
+		else if (arg == ARG_STR("--stream"))
+		{
+			opts.stream = true;
+		}
+		else if (arg == ARG_STR("--watch"))
+		{
+			opts.watch = true;
+		}
+		else if (arg == ARG_STR("--stats") && argi + 1 < argc)
+		{
+			opts.stats_file = argv[++argi];
+		}
+		else if (arg == ARG_STR("--cache") && argi + 1 < argc)
+		{
+			opts.cache_dir = argv[++argi];
+		}
+		else if (arg == ARG_STR("--batch"))
+		{
+			// Everything else is <infile> <outfile> pairs
+			batch = true;
+			for (++argi; argi + 1 < argc; argi += 2)
+				jobs.push_back(batch_job(argv[argi], argv[argi + 1]));
+			if (argi != argc || jobs.empty())
+			{
+				usage();
+				return 1;
+			}
+			break;
+		}
+		else if (arg == ARG_STR("--manifest") && argi + 1 < argc)
+		{
+			batch = true;
+			if (!read_manifest(argv[++argi], jobs))
+				return 1;
+		}
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	// Only the macros can be written a block at a time, the extras,
+	// checks and database need every register first, there is only one database and
+	// dependency file, split headers need somewhere to go and are not
+	// cached, dependencies need an output to be dependencies of, and
+	// watching one file keeps its parse, which streaming doesn't
+	const bool c_extras = opts.update || opts.shadow || opts.overlay || opts.dispatch ||
+		opts.names;
+	const bool by_register = c_extras || opts.check || !opts.db_file.empty();
+	if ((opts.stream && (opts.backend != hwdc_options::c || by_register || opts.split)) ||
+		(c_extras && opts.backend != hwdc_options::c) ||
+		(batch && (!opts.db_file.empty() || !opts.deps_file.empty())) ||
+		(opts.split && (!opts.cache_dir.empty() || (!batch && argc - argi < 2))) ||
+		(!opts.deps_file.empty() && !batch && argc - argi < 2) ||
+		(opts.watch && (batch || opts.stream || opts.parse_only || argc - argi < 2)))
 	{
-		wcerr << L"Usage: hwdc2 <infile>\n";
+		usage();
 		return 1;
 	}
 
-	try
+	if (batch)
 	{
-		pp_stream src(argv[1]);
-		thing_sequence things(src);
-		if (argc <= 2)
-			things.generate_c(wcout, NULL);
-		else
+		if (argi != argc)
 		{
-			wofstream outs(argv[2]);
-			things.generate_c(outs, NULL);
+			usage();
+			return 1;
 		}
+		return run_batch(jobs, n_threads, opts) ? 0 : 1;
 	}
-	catch (hwdc_error& err)
+
+	if (argc - argi < 1 || argc - argi > 2)
 	{
-		wcout << wstring(err) << L"\n";
+		usage();
+		return 1;
 	}
 
-	return 0;
-}
+	// One file to ourselves so spread its blocks over all the threads
+	opts.threads = n_threads;
+	if (opts.watch)
+		return watch(argv[argi], argv[argi + 1], opts);
 
+	compile_stats stats(argv[argi]);
+	const bool ok = compile(argv[argi], argc - argi <= 1 ? NULL : argv[argi + 1], opts, wcout, stats);
+	if (!opts.stats_file.empty())
+		write_stats(opts.stats_file, stats.json());
+
+	return ok ? 0 : 1;
+}
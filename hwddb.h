@@ -0,0 +1,91 @@
+/*
+ * Layout of the register database written by hwdc2 --db
+ *
+ * The file is little endian and, but for the string table, made of 32 bit
+ * words, so on a little endian host it can be mapped and used as it is.
+ * The header gives where each table starts.  Records refer to each other
+ * by index and to names by offset into the string table, where each name
+ * is NUL terminated.  A block's registers, a register's fields and a
+ * field's values are each consecutive records.
+ */
+
+#ifndef HWDDB_H
+#define HWDDB_H
+
+#include <stdint.h>
+
+#define HWDDB_MAGIC 0x42445748		/* "HWDB" */
+#define HWDDB_VERSION 1
+#define HWDDB_NONE 0xffffffffU
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;		/* sizeof(hwddb_header) in this version */
+	uint32_t file_size;
+	uint32_t n_blocks;
+	uint32_t blocks;			/* File offset of the first */
+	uint32_t n_registers;
+	uint32_t registers;
+	uint32_t n_fields;
+	uint32_t fields;
+	uint32_t n_values;
+	uint32_t values;
+	uint32_t strings_size;
+	uint32_t strings;
+} hwddb_header;
+
+typedef struct
+{
+	uint32_t name;
+	uint32_t qname;
+	uint32_t first_register;
+	uint32_t n_registers;
+} hwddb_block;
+
+#define HWDDB_REG_OFFSET 1			/* offset is known */
+#define HWDDB_REG_RESET 2			/* reset is known */
+#define HWDDB_REG_REFETCH 4			/* Has read only fields */
+
+typedef struct
+{
+	uint32_t name;
+	uint32_t qname;
+	uint32_t block;
+	uint32_t flags;
+	uint32_t offset;
+	uint32_t reset;
+	uint32_t first_field;
+	uint32_t n_fields;
+} hwddb_register;
+
+#define HWDDB_FIELD_RO 1
+
+typedef struct
+{
+	uint32_t name;
+	uint32_t qname;
+	uint32_t reg;
+	uint32_t flags;
+	uint32_t shift;
+	uint32_t width;
+	uint32_t mask;				/* In place */
+	uint32_t val_shift;
+	uint32_t first_value;
+	uint32_t n_values;
+} hwddb_field;
+
+#define HWDDB_VALUE_NUMBER 1		/* number is the value, else only text */
+
+typedef struct
+{
+	uint32_t name;
+	uint32_t qname;
+	uint32_t field;
+	uint32_t flags;
+	int32_t number;
+	uint32_t text;
+} hwddb_value;
+
+#endif
@@ -2,12 +2,16 @@
 #define PTR_HXX
 
 #include <stdlib.h>
+#include <string.h>
+#include <new>
 
 #define NEXCEPT 1
 
 // Common templates
 namespace std {
 
+class Arena;
+
 //----------------------------------------------------------------------------
 //
 // Smart pointer (with reference counts)
@@ -46,6 +50,14 @@ public:
 
 	Ptr (T * const in);
 	Ptr (const Ptr &in);
+
+	// Moving takes over in's reference so the count is left alone
+
+	Ptr (Ptr &&in) :
+		p (in.p)
+	{
+		in.p = 0;
+	}
 	
 	// Destructor
 
@@ -75,10 +87,33 @@ public:
 	{
 		deref ();
 	}
-	inline const Ptr& operator= (const Ptr in)
+
+	// Give up our reference without dropping it, for whoever takes over
+	// the count
+
+	inline T * release ()
+	{
+		T * const x = p;
+		p = 0;
+		return x;
+	}
+
+	inline const Ptr& operator= (const Ptr &in)
 	{
 		return PtrSet (in);
 	}
+	// Taking in's pointer first as in may be freed by our deref
+	inline const Ptr& operator= (Ptr &&in)
+	{
+		if (&in != this)
+		{
+			T * const x = in.p;
+			in.p = 0;
+			deref ();
+			p = x;
+		}
+		return *this;
+	}
 	inline const Ptr& operator= (T * const in)
 	{
 		return PtrSet (in);
@@ -128,15 +163,13 @@ Ptr<T>::PtrSet (T * const in)
 	return *this;
 }
 
+// By way of the plain pointer as in may be us, or be freed by our deref
+
 template <class T>
 const Ptr<T>&
 Ptr<T>::PtrSet (const Ptr<T>& in)
 {
-	if (!in.isnull ())
-		in->IncReferenceCount ();
-	deref ();
-	p = in.p;
-	return *this;
+	return PtrSet (in.p);
 }
 
 template <class T>
@@ -160,7 +193,8 @@ Ptr<T>::Ptr (const Ptr<T>& in) :
 // The base class for thisngs that are pointed to be Ptr<T> and PtrList<T>
 // classes.  Maintains ref count
 //
-// Should probably be declared as a virtual base class whenever used...
+// A plain base is best - as a virtual base every count change has to find
+// it first.  Only make it virtual where a class would otherwise get two.
 
 class Pted
 {
@@ -237,7 +271,7 @@ class Ptr1
 	T * p;
 
 	Ptr1 (const Ptr1 &in);  // Copy not allowed
-	Ptr1& operator= (const Ptr1 in);
+	Ptr1& operator= (const Ptr1 &in);
 
 public:
 	// We zero p before deleteing it so we can write MAD code safely
@@ -264,6 +298,27 @@ public:
 	{
 		// Empty
 	}
+
+	// Moving hands over the one pointer
+
+	Ptr1 (Ptr1 &&in) :
+		p (in.p)
+	{
+		in.p = 0;
+	}
+
+	// Taking in's pointer first as in may be freed by our null
+	Ptr1& operator= (Ptr1 &&in)
+	{
+		if (&in != this)
+		{
+			T * const x = in.p;
+			in.p = 0;
+			null ();
+			p = x;
+		}
+		return *this;
+	}
 	
 	// Destructor - zero p in case of MAD
 
@@ -330,43 +385,70 @@ Ptr1<T>::null ()
 // Convienient 'list of dumb pointers' code
 // Allows easy adding of new stuff.
 // Doesn't delete refs on deleteion of List
+//
+// The first few entries live in the list itself, as most lists are short,
+// and after that the array doubles whenever it fills so adding is never
+// worse than copying everything twice over.
+//
+// An array from adopt is someone else's, marked by allocated being 0 as
+// it is always full, and is copied to one of our own if we need to grow.
 
 template<class T>
 class PList
 {
 protected:
+	enum { n_inline = 4 };
+
 	T** parray;
 	size_t allocated, alen;
+	T* inline_array [n_inline];
 
 	void newalloc ()
 	{
-		if (alen >= allocated)
+		if (alen < allocated)
+			return;
+
+		// Only an adopted array can be full with room to spare inline
+		if (alen < n_inline)
 		{
-			if (allocated == 0)
-			{
-				allocated = 4;
-				parray = (T**)malloc (sizeof (T*) * allocated);
-//				if ((parray = (T**)malloc (sizeof (T*) * allocated)) == 0)
-//					_standard_new_handler (sizeof (T*) * allocated);
-			}
-			else
-			{
-				if (allocated < 64)
-					allocated *= 2;
-				else
-					allocated += 64;
-
-				parray = (T**)realloc (parray, sizeof (T*) * allocated);
-					/* panic */;
-//					_standard_new_handler (sizeof (T*) * allocated);
-			}
+			memcpy (inline_array, parray, sizeof (T*) * alen);
+			parray = inline_array;
+			allocated = n_inline;
+			return;
+		}
+
+		T** p;
+		if (parray == inline_array || allocated == 0)
+		{
+			if ((p = (T**)malloc (sizeof (T*) * alen * 2)) != 0)
+				memcpy (p, parray, sizeof (T*) * alen);
 		}
+		else
+		{
+			p = (T**)realloc (parray, sizeof (T*) * alen * 2);
+		}
+
+		// The old array is still ours if that failed
+		if (p == 0)
+			throw bad_alloc ();
+		parray = p;
+		allocated = alen * 2;
 	}
 
+	void freealloc ()
+	{
+		if (parray != inline_array && allocated != 0)
+			free (parray);
+	}
+
+private:
+	PList (const PList&);  // Copy not allowed
+	PList& operator= (const PList&);
+
 public:
 	PList () :
-		parray (0),
-		allocated (0),
+		parray (inline_array),
+		allocated (n_inline),
 		alen (0)
 	{
 		// Empty
@@ -374,8 +456,7 @@ public:
 
 	~PList ()
 	{
-		if (allocated != 0)
-			free (parray);
+		freealloc ();
 	}
 
 	PList& operator << (T * const x)
@@ -464,6 +545,12 @@ public:
 			set ((size_t)offset, 0);
 	}
 
+	// Make our entries the n at from, in place of any we had
+	// Too many to keep in the list itself go in an array from arena, which
+	// must outlive us.
+
+	void adopt (T * const * const from, const size_t n, Arena& arena);
+
 	T * replace (const size_t offset, T * const x);
 	void deletel (const size_t offset);
 	void deleteall ();
@@ -516,8 +603,8 @@ class PtrList : private PList<T>
 {
 public:
 	// Export some stuff
-	PList<T>::operator [];
-	PList<T>::len;
+	using PList<T>::operator [];
+	using PList<T>::len;
 
 	// The enstuffing operators
 
@@ -528,13 +615,22 @@ public:
 		return *this;
 	}
 
-	PtrList& operator << (const Ptr<T> x)
+	PtrList& operator << (const Ptr<T> &x)
 	{
 		PList<T>::operator << ((T *)x);
 		x->IncReferenceCount ();
 		return *this;
 	}
 
+	// Taking over x's reference saves a count up and down
+
+	PtrList& operator << (Ptr<T> &&x)
+	{
+		PList<T>::operator << ((T *)x);
+		x.release ();
+		return *this;
+	}
+
 	// Insert / Remove can be used if we don't care about ordering
 
 	size_t insert (T * const x)
@@ -544,6 +640,27 @@ public:
 		return i;
 	}
 
+	// Put x in place of entry i
+
+	PtrList& set (const size_t i, T * const x)
+	{
+		T * const old = PList<T>::parray [i];
+		x->IncReferenceCount ();
+		PList<T>::set (i, x);
+		if (old != 0)
+			old->DecReferenceCount ();
+		return *this;
+	}
+
+	// Take over the n references at from as our entries, in place of any
+	// we had, any array needed coming from arena
+
+	void adopt (T * const * const from, const size_t n, Arena& arena)
+	{
+		empty ();
+		PList<T>::adopt (from, n, arena);
+	}
+
 	PtrList& remove (const size_t i)
 	{
 		T * const p = PList<T>::parray [i];
@@ -570,6 +687,133 @@ public:
 	}
 };
 
+//--------------------------------- Arena ------------------------------------
+//
+// Bump allocator for lots of small objects that all die together.
+// Memory is handed out from large blocks and only returned when the Arena
+// itself is deleted - there is no per-object free.  Objects placed in here
+// still need their destructors run by whoever owns them.
+
+class Arena
+{
+	struct Block
+	{
+		Block * next;
+	};
+
+	// Enough for anything we are likely to put in here
+	enum { align = 16 };
+
+	Block * blocks;
+	char * cur;
+	char * limit;
+	size_t block_size;
+
+	Arena (const Arena&);  // Copy not allowed
+	Arena& operator= (const Arena&);
+
+	void * grow (const size_t n);
+
+	static inline size_t round_up (const size_t n)
+	{
+		return (n + align - 1) & ~(size_t)(align - 1);
+	}
+
+public:
+	Arena (const size_t first_block = 64 * 1024) :
+		blocks (0),
+		cur (0),
+		limit (0),
+		block_size (first_block)
+	{
+		// Empty
+	}
+
+	~Arena ()
+	{
+		while (blocks != 0)
+		{
+			Block * const b = blocks;
+			blocks = b->next;
+			free (b);
+		}
+	}
+
+	// Forget everything allocated so far, keeping the latest (and biggest)
+	// block to allocate from again.  Nothing in here may still be in use.
+
+	void reset ()
+	{
+		if (blocks == 0)
+			return;
+
+		while (blocks->next != 0)
+		{
+			Block * const b = blocks->next;
+			blocks->next = b->next;
+			free (b);
+		}
+		cur = (char *)blocks + round_up (sizeof (Block));
+	}
+
+	inline void * alloc (size_t n)
+	{
+		n = round_up (n);
+		if ((size_t)(limit - cur) < n)
+			return grow (n);
+
+		void * const p = cur;
+		cur += n;
+		return p;
+	}
+};
+
+// Start a new block big enough for n, doubling block size as we go (up to
+// a limit) so big inputs don't end up with a very long block chain
+
+inline void *
+Arena::grow (const size_t n)
+{
+	const size_t hdr = round_up (sizeof (Block));
+	size_t size = block_size;
+
+	if (size < hdr + n)
+		size = hdr + n;
+	else if (block_size < 4 * 1024 * 1024)
+		block_size *= 2;
+
+	Block * const b = (Block *)malloc (size);
+	if (b == 0)
+		throw bad_alloc ();
+	b->next = blocks;
+	blocks = b;
+
+	char * const p = (char *)b + hdr;
+	cur = p + n;
+	limit = (char *)b + size;
+	return p;
+}
+
+template<class T>
+void
+PList<T>::adopt (T * const * const from, const size_t n, Arena& arena)
+{
+	freealloc ();
+	if (n <= n_inline)
+	{
+		parray = inline_array;
+		allocated = n_inline;
+	}
+	else
+	{
+		parray = (T**)arena.alloc (sizeof (T*) * n);
+		allocated = 0;
+	}
+	if (n != 0)
+		memcpy (parray, from, sizeof (T*) * n);
+	alen = n;
+}
+
 } // namespace
 
 #endif
\ No newline at end of file